@@ -0,0 +1,665 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <gmp.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "cli.h"
+#include "cli_convert.h"
+#include "log.h"
+#include "rand.h"
+#include "rcmem.h"
+#include "plots/troll_eq_plot.h"
+#include "server.h"
+#include "utils.h"
+
+// End-to-end load generator. It runs the server with troll_eq_plot in this process and plays whole
+// sessions (every eq, every python_shellcode and the flag) against it from loopback clients
+
+#define BENCH_EVENTS_NR 256
+#define BENCH_IN_BUF_MIN 4096
+
+enum bench_stage {
+    BENCH_STAGE_EQ,
+    BENCH_STAGE_PYTHON_SHELLCODE,
+    BENCH_STAGE_ECHO,
+    BENCH_STAGES_NR
+};
+
+static const char *const bench_stage_names[BENCH_STAGES_NR] = {
+    [BENCH_STAGE_EQ] = "eq",
+    [BENCH_STAGE_PYTHON_SHELLCODE] = "python_shellcode",
+    [BENCH_STAGE_ECHO] = "echo"
+};
+
+// Nanoseconds from the answer (or the connect for the first question) to the whole next question
+struct bench_samples {
+    unsigned long *nsec;
+    size_t nr;
+    size_t size;
+};
+
+struct bench_conn {
+    int fd;
+    char *in;   // Received bytes that aren't a whole question yet
+    size_t in_len;
+    size_t in_size;
+    char *out;   // Answer bytes the socket hasn't taken yet
+    size_t out_len;
+    size_t out_off;
+    struct timespec since;
+};
+
+struct bench_ctx {
+    unsigned short port;
+    unsigned long sessions_target;
+    unsigned long sessions_started;   // Atomic
+};
+
+struct bench_thread {
+    pthread_t thread;
+    struct bench_ctx *ctx;
+    int epfd;
+    unsigned conns_nr;
+    struct bench_conn *conns;
+    unsigned active;
+
+    struct bench_samples samples[BENCH_STAGES_NR];
+    unsigned long tasks;
+    unsigned long sessions;
+    unsigned long errors;
+};
+
+static unsigned long timespec_diff_nsec(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000000ul + to->tv_nsec - from->tv_nsec;
+}
+
+static int bench_samples_add(struct bench_samples *s, unsigned long nsec) {
+    if ( s->nr == s->size ) {
+        size_t size = s->size ? s->size * 2 : 1024;
+        unsigned long *nsecs = realloc(s->nsec, size * sizeof(*nsecs));
+        if ( nsecs == NULL ) return -1;
+        s->nsec = nsecs;
+        s->size = size;
+    }
+
+    s->nsec[s->nr++] = nsec;
+    return 0;
+}
+
+static int bench_samples_merge(struct bench_samples *to, const struct bench_samples *from) {
+    for ( size_t i = 0; i < from->nr; i++ ) {
+        if ( bench_samples_add(to, from->nsec[i]) ) return -1;
+    }
+    return 0;
+}
+
+static int ulong_cmp(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+    return (x > y) - (x < y);
+}
+
+// The samples must be sorted
+static double bench_samples_percentile_usec(const struct bench_samples *s, double q) {
+    if ( s->nr == 0 ) return 0.0;
+    size_t i = q * s->nr;
+    if ( i >= s->nr ) i = s->nr - 1;
+    return s->nsec[i] / 1000.0;
+}
+
+// Eq text solver, the same grammar eq_solve walks: expression = term {(+|-) term}, term = primary {* primary}
+
+static bool bench_eq_expression(const char **s, mpz_t out);
+
+static bool bench_eq_primary(const char **s, mpz_t out) {
+    if ( **s == '(' ) {
+        (*s)++;
+        if ( !bench_eq_expression(s, out) ) return false;
+        if ( **s != ')' ) return false;
+        (*s)++;
+        return true;
+    }
+
+    const char *start = *s;
+    while ( isdigit((unsigned char)**s) ) (*s)++;
+    if ( *s == start ) return false;
+
+    char *nr = strndup(start, *s - start);
+    if ( nr == NULL ) return false;
+    int r = mpz_set_str(out, nr, 10);
+    free(nr);
+
+    return r == 0;
+}
+
+static bool bench_eq_term(const char **s, mpz_t out) {
+    if ( !bench_eq_primary(s, out) ) return false;
+
+    mpz_t right;
+    mpz_init(right);
+    while ( **s == '*' ) {
+        (*s)++;
+        if ( !bench_eq_primary(s, right) ) goto fail;
+        mpz_mul(out, out, right);
+    }
+    mpz_clear(right);
+    return true;
+
+fail:
+    mpz_clear(right);
+    return false;
+}
+
+static bool bench_eq_expression(const char **s, mpz_t out) {
+    if ( !bench_eq_term(s, out) ) return false;
+
+    mpz_t right;
+    mpz_init(right);
+    while ( **s == '+' || **s == '-' ) {
+        char op = *(*s)++;
+        if ( !bench_eq_term(s, right) ) goto fail;
+        if ( op == '+' ) {
+            mpz_add(out, out, right);
+        } else {
+            mpz_sub(out, out, right);
+        }
+    }
+    mpz_clear(right);
+    return true;
+
+fail:
+    mpz_clear(right);
+    return false;
+}
+
+// Returns a malloced answer line or NULL
+static char *bench_eq_answer(const char *text) {
+    mpz_t res;
+    mpz_init(res);
+
+    char *answer = NULL;
+    const char *s = text;
+    if ( bench_eq_expression(&s, res) && *s == '\0' ) {
+        answer = malloc(mpz_sizeinbase(res, 10) + 3);   // Sign, newline and zero byte
+        if ( answer != NULL ) {
+            mpz_get_str(answer, 10, res);
+            strcat(answer, "\n");
+        }
+    }
+
+    mpz_clear(res);
+    return answer;
+}
+
+static const char python_shellcode_marker[] = "#Hehehe, answer: ";
+static const char flag_prefix[] = "qekactf{";
+
+static enum bench_stage bench_question_stage(const char *text) {
+    if ( !strncmp(text, flag_prefix, sizeof(flag_prefix) - 1) ) return BENCH_STAGE_ECHO;
+    if ( strstr(text, python_shellcode_marker) != NULL ) return BENCH_STAGE_PYTHON_SHELLCODE;
+    return BENCH_STAGE_EQ;
+}
+
+static void bench_conn_close(struct bench_thread *bt, struct bench_conn *conn) {
+    close(conn->fd);   // It leaves the epoll set too
+    conn->fd = -1;
+    conn->in_len = 0;
+    free(conn->out);
+    conn->out = NULL;
+    conn->out_len = 0;
+    conn->out_off = 0;
+    bt->active--;
+}
+
+// Starts a new session on the connection slot if the target isn't reached yet
+static void bench_conn_start(struct bench_thread *bt, struct bench_conn *conn) {
+    struct bench_ctx *ctx = bt->ctx;
+
+    while ( __atomic_fetch_add(&ctx->sessions_started, 1, __ATOMIC_RELAXED) < ctx->sessions_target ) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if ( fd == -1 ) goto error;
+
+        struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(ctx->port),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+        };
+
+        clock_gettime(CLOCK_MONOTONIC, &conn->since);
+        if ( connect(fd, (struct sockaddr *)&addr, sizeof(addr)) && errno != EINPROGRESS ) goto close_fd;
+
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn};
+        if ( epoll_ctl(bt->epfd, EPOLL_CTL_ADD, fd, &ev) ) goto close_fd;
+
+        conn->fd = fd;
+        bt->active++;
+        return;
+
+    close_fd:
+        close(fd);
+    error:
+        bt->errors++;
+    }
+}
+
+static int bench_conn_flush(struct bench_thread *bt, struct bench_conn *conn) {
+    while ( conn->out_off < conn->out_len ) {
+        ssize_t res = send(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off, MSG_NOSIGNAL);
+        if ( res == -1 && errno == EAGAIN ) break;
+        if ( res == -1 ) return -1;
+        conn->out_off += res;
+    }
+
+    bool pending = conn->out_off < conn->out_len;
+    if ( !pending ) {
+        free(conn->out);
+        conn->out = NULL;
+        conn->out_len = 0;
+        conn->out_off = 0;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | (pending ? EPOLLOUT : 0), .data.ptr = conn};
+    return epoll_ctl(bt->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+// Returns 1 when the session is over, -1 on failure
+static int bench_conn_answer(struct bench_thread *bt, struct bench_conn *conn, char *text) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    enum bench_stage stage = bench_question_stage(text);
+    if ( bench_samples_add(&bt->samples[stage], timespec_diff_nsec(&conn->since, &now)) ) return -1;
+    bt->tasks++;
+
+    if ( stage == BENCH_STAGE_ECHO ) return 1;
+
+    assert(conn->out == NULL);
+    if ( stage == BENCH_STAGE_PYTHON_SHELLCODE ) {
+        const char *answer = strstr(text, python_shellcode_marker) + sizeof(python_shellcode_marker) - 1;
+        if ( asprintf(&conn->out, "%s\n", answer) == -1 ) conn->out = NULL;
+    } else {
+        conn->out = bench_eq_answer(text);
+    }
+    if ( conn->out == NULL ) return -1;
+
+    conn->out_len = strlen(conn->out);
+    clock_gettime(CLOCK_MONOTONIC, &conn->since);
+    return bench_conn_flush(bt, conn);
+}
+
+// Returns 1 when the session is over, -1 on failure
+static int bench_conn_read(struct bench_thread *bt, struct bench_conn *conn) {
+    while ( true ) {
+        if ( conn->in_len + 1 >= conn->in_size ) {   // One byte is kept for the zero byte
+            size_t size = conn->in_size ? conn->in_size * 2 : BENCH_IN_BUF_MIN;
+            char *in = realloc(conn->in, size);
+            if ( in == NULL ) return -1;
+            conn->in = in;
+            conn->in_size = size;
+        }
+
+        ssize_t res = recv(conn->fd, conn->in + conn->in_len, conn->in_size - conn->in_len - 1, 0);
+        if ( res == -1 && errno == EAGAIN ) break;
+        if ( res <= 0 ) return -1;   // The server never closes first while the session goes on
+        conn->in_len += res;
+        if ( conn->in_len + 1 < conn->in_size ) break;   // The socket is drained
+    }
+
+    // A question ends with "\nAnswer (...): ", the no timeout prompt has a zero byte after it
+    while ( true ) {
+        conn->in[conn->in_len] = '\0';
+        size_t skip = 0;
+        while ( skip < conn->in_len && conn->in[skip] == '\0' ) skip++;
+
+        char *text = conn->in + skip;
+        char *prompt = memmem(text, conn->in_len - skip, "\nAnswer (", 9);
+        if ( prompt == NULL ) return 0;
+        char *end = memmem(prompt, conn->in_len - (prompt - conn->in), "): ", 3);
+        if ( end == NULL ) return 0;
+
+        *prompt = '\0';
+        int res = bench_conn_answer(bt, conn, text);
+        if ( res ) return res;
+
+        end += 3;
+        conn->in_len -= end - conn->in;
+        memmove(conn->in, end, conn->in_len);
+    }
+}
+
+static void bench_conn_event(struct bench_thread *bt, struct bench_conn *conn, uint32_t events) {
+    int res = 0;
+
+    if ( events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP) ) res = bench_conn_read(bt, conn);
+    if ( res == 0 && (events & EPOLLOUT) && conn->out != NULL ) res = bench_conn_flush(bt, conn);
+
+    if ( res == 0 ) return;
+    if ( res == 1 ) {
+        bt->sessions++;
+    } else {
+        bt->errors++;
+    }
+
+    bench_conn_close(bt, conn);
+    bench_conn_start(bt, conn);
+}
+
+static void *bench_thread_run(void *arg) {
+    struct bench_thread *bt = arg;
+    struct epoll_event evs[BENCH_EVENTS_NR];
+
+    for ( unsigned i = 0; i < bt->conns_nr; i++ ) bench_conn_start(bt, &bt->conns[i]);
+
+    while ( bt->active > 0 ) {
+        int res = epoll_wait(bt->epfd, evs, BENCH_EVENTS_NR, -1);
+        if ( res == -1 && errno == EINTR ) continue;
+        if ( res == -1 ) break;
+
+        for ( int i = 0; i < res; i++ ) bench_conn_event(bt, evs[i].data.ptr, evs[i].events);
+    }
+
+    return NULL;
+}
+
+static int bench_thread_init(struct bench_thread *bt, struct bench_ctx *ctx, unsigned conns_nr) {
+    memset(bt, 0, sizeof(*bt));
+    bt->ctx = ctx;
+    bt->conns_nr = conns_nr;
+
+    bt->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if ( bt->epfd == -1 ) return -1;
+
+    bt->conns = calloc(conns_nr, sizeof(struct bench_conn));
+    if ( bt->conns == NULL ) {
+        close(bt->epfd);
+        return -1;
+    }
+
+    for ( unsigned i = 0; i < conns_nr; i++ ) bt->conns[i].fd = -1;
+    return 0;
+}
+
+static void bench_thread_fini(struct bench_thread *bt) {
+    for ( unsigned i = 0; i < bt->conns_nr; i++ ) {
+        free(bt->conns[i].in);
+        free(bt->conns[i].out);
+        if ( bt->conns[i].fd != -1 ) close(bt->conns[i].fd);
+    }
+    free(bt->conns);
+    close(bt->epfd);
+
+    for ( unsigned s = 0; s < BENCH_STAGES_NR; s++ ) free(bt->samples[s].nsec);
+}
+
+// Every client holds two descriptors in this process, the default soft limit is too low for thousands
+static void raise_nofile_limit() {
+    struct rlimit rl;
+    if ( getrlimit(RLIMIT_NOFILE, &rl) ) return;
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+static int cli_convert_balance_policy(const char *s, struct cli_opt_arg *out) {
+    enum server_balance_policy policy;
+    if ( server_balance_policy_from_name(s, &policy) ) return -1;
+
+    out->data.i = policy;
+    out->data_free = NULL;
+    return 0;
+}
+
+static int cli_convert_backend(const char *s, struct cli_opt_arg *out) {
+    enum server_backend backend;
+    if ( server_backend_from_name(s, &backend) ) return -1;
+
+    out->data.i = backend;
+    out->data_free = NULL;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    log_set_file(stderr);
+    log_set_flags(LOG_WARN);
+
+    struct server_config config = {
+        .workers_nr = sysconf(_SC_NPROCESSORS_ONLN),
+        .flags = 0,
+        .accept_batch = 0,
+        .events_batch = 0,
+        .balance = SERVER_BALANCE_LEAST_CLIENTS,
+        .backend = SERVER_BACKEND_EPOLL,
+        .zerocopy_min = 0
+    };
+    unsigned short port = 31337;
+    unsigned clients = 1000;
+    unsigned threads = 4;
+    unsigned long sessions = 10000;
+    unsigned long seed = time(NULL);
+    int log_lvl = LOG_WARN;
+    int ret = EXIT_FAILURE;
+
+    struct cli *cli = cli_create(CLI_STRICT | CLI_AUTO_HELP, NULL);
+    if ( !cli ) {
+        log_msg(LOG_CRITICAL, "Failed to init cli\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct cli_opt opts[] = {
+        {
+         .id = "log_lvl",
+         .long_name = "log-lvl",
+         .short_name = 'l',
+         .flags = CLI_OPT_HAS_ARG,
+         .parser = cli_convert_i,
+         .description = "Verbosity level of the server",
+         },
+        {
+         .id = "port",
+         .long_name = "port",
+         .short_name = 'p',
+         .flags = CLI_OPT_HAS_ARG,
+         .parser = cli_convert_su,
+         .description = "Loopback port for the server",
+         },
+        {
+         .id = "clients",
+         .long_name = "clients",
+         .short_name = 'c',
+         .flags = CLI_OPT_HAS_ARG,
+         .parser = cli_convert_u,
+         .description = "Concurrent client connections",
+         },
+        {
+         .id = "sessions",
+         .long_name = "sessions",
+         .short_name = 's',
+         .flags = CLI_OPT_HAS_ARG,
+         .parser = cli_convert_ul,
+         .description = "Sessions to play from the first question to the flag",
+         },
+        {
+         .id = "threads",
+         .long_name = "threads",
+         .short_name = 't',
+         .flags = CLI_OPT_HAS_ARG,
+         .parser = cli_convert_u,
+         .description = "Client threads",
+         },
+        {
+         .id = "seed",
+         .long_name = "seed",
+         .short_name = 'S',
+         .flags = CLI_OPT_HAS_ARG,
+         .parser = cli_convert_ul,
+         .description = "Seed of the generated tasks, the same seed gives comparable runs",
+         },
+        {
+         .id = "workers_nr",
+         .long_name = "workers-nr",
+         .short_name = 'w',
+         .flags = CLI_OPT_HAS_ARG,
+         .parser = cli_convert_u,
+         .description = "Number of server worker threads",
+         },
+        {
+         .id = "reuseport",
+         .long_name = "reuseport",
+         .short_name = 'r',
+         .flags = 0,
+         .parser = NULL,
+         .description = "Accept connections on every worker with SO_REUSEPORT sockets",
+         },
+        {
+         .id = "balance",
+         .long_name = "balance",
+         .short_name = 'b',
+         .flags = CLI_OPT_HAS_ARG,
+         .parser = cli_convert_balance_policy,
+         .description = "Worker choice for new clients: least, rr, p2c or cost (ignored with --reuseport)",
+         },
+        {
+         .id = "backend",
+         .long_name = "backend",
+         .short_name = 'e',
+         .flags = CLI_OPT_HAS_ARG,
+         .parser = cli_convert_backend,
+         .description = "Worker event loop: epoll or uring (falls back to epoll without io_uring)",
+         }
+    };
+
+    if ( cli_add_opts(cli, opts, countof(opts)) ) {
+        log_msg(LOG_CRITICAL, "Failed to add opts\n");
+        cli_destroy(cli);
+        exit(EXIT_FAILURE);
+    }
+
+    struct cli_match *m = cli_match(cli, argc - 1, argv + 1);
+    if ( !m ) {
+        log_msg(LOG_CRITICAL, "Failed to parse args\n");
+        cli_destroy(cli);
+        exit(EXIT_FAILURE);
+    }
+
+    struct cli_opt_arg *arg;
+    arg = cli_match_get_arg(m, "log_lvl");
+    if ( arg ) { log_lvl = arg->data.i; }
+    arg = cli_match_get_arg(m, "port");
+    if ( arg ) { port = arg->data.su; }
+    arg = cli_match_get_arg(m, "clients");
+    if ( arg ) { clients = arg->data.u; }
+    arg = cli_match_get_arg(m, "sessions");
+    if ( arg ) { sessions = arg->data.ul; }
+    arg = cli_match_get_arg(m, "threads");
+    if ( arg ) { threads = arg->data.u; }
+    arg = cli_match_get_arg(m, "seed");
+    if ( arg ) { seed = arg->data.ul; }
+    arg = cli_match_get_arg(m, "workers_nr");
+    if ( arg ) { config.workers_nr = arg->data.u; }
+    size_t args_nr;
+    if ( !cli_match_get_args_nr(m, "reuseport", &args_nr) ) { config.flags |= SERVER_REUSEPORT; }
+    arg = cli_match_get_arg(m, "balance");
+    if ( arg ) { config.balance = arg->data.i; }
+    arg = cli_match_get_arg(m, "backend");
+    if ( arg ) { config.backend = arg->data.i; }
+
+    cli_match_destroy(m);
+    cli_destroy(cli);
+
+    log_set_flags(log_lvl);
+
+    if ( threads == 0 ) threads = 1;
+    if ( clients < threads ) clients = threads;
+
+    raise_nofile_limit();
+    rand_seed(seed);   // Every gen draws from rand.h, so the same seed gives the same tasks
+
+    struct server *server = server_create(&config);
+    if ( server == NULL ) {
+        log_msg(LOG_CRITICAL, "Failed to launch server\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ( server_add_plot(server, troll_eq_plot_create, port) ) {
+        log_msg(LOG_CRITICAL, "Failed to add troll_eq_plot\n");
+        goto destroy_server;
+    }
+
+    struct bench_ctx ctx = {.port = port, .sessions_target = sessions, .sessions_started = 0};
+
+    struct bench_thread *bts = calloc(threads, sizeof(struct bench_thread));
+    if ( bts == NULL ) goto destroy_server;
+
+    unsigned inited = 0;
+    for ( ; inited < threads; inited++ ) {
+        unsigned conns_nr = clients / threads + (inited < clients % threads);
+        if ( bench_thread_init(&bts[inited], &ctx, conns_nr) ) {
+            log_msg(LOG_CRITICAL, "Failed to init client thread\n");
+            goto fini_threads;
+        }
+    }
+
+    printf(
+        "seed %lu, %u clients on %u threads, %lu sessions, %u workers (%s backend%s)\n", seed, clients, threads,
+        sessions, config.workers_nr, server_backend_name(config.backend),
+        (config.flags & SERVER_REUSEPORT) ? ", reuseport" : ""
+    );
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    unsigned started = 0;
+    for ( ; started < threads; started++ ) {
+        if ( pthread_create(&bts[started].thread, NULL, bench_thread_run, &bts[started]) ) {
+            log_msg(LOG_CRITICAL, "Failed to start client thread\n");
+            __atomic_store_n(&ctx.sessions_started, sessions, __ATOMIC_RELAXED);   // Let the started ones finish
+            break;
+        }
+    }
+    for ( unsigned i = 0; i < started; i++ ) pthread_join(bts[i].thread, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = timespec_diff_nsec(&start, &end) / 1e9;
+
+    unsigned long total_sessions = 0, total_tasks = 0, total_errors = 0;
+    struct bench_samples merged[BENCH_STAGES_NR] = {0};
+    for ( unsigned i = 0; i < started; i++ ) {
+        total_sessions += bts[i].sessions;
+        total_tasks += bts[i].tasks;
+        total_errors += bts[i].errors;
+        for ( unsigned s = 0; s < BENCH_STAGES_NR; s++ ) bench_samples_merge(&merged[s], &bts[i].samples[s]);
+    }
+
+    printf("%lu sessions, %lu errors in %.3f s\n", total_sessions, total_errors, elapsed);
+    printf("connections/s: %.1f\n", total_sessions / elapsed);
+    printf("tasks/s: %.1f\n", total_tasks / elapsed);
+    printf("%-18s %10s %12s %12s %12s\n", "stage", "questions", "p50 us", "p99 us", "p999 us");
+    for ( unsigned s = 0; s < BENCH_STAGES_NR; s++ ) {
+        qsort(merged[s].nsec, merged[s].nr, sizeof(unsigned long), ulong_cmp);
+        printf(
+            "%-18s %10zu %12.1f %12.1f %12.1f\n", bench_stage_names[s], merged[s].nr,
+            bench_samples_percentile_usec(&merged[s], 0.50), bench_samples_percentile_usec(&merged[s], 0.99),
+            bench_samples_percentile_usec(&merged[s], 0.999)
+        );
+        free(merged[s].nsec);
+    }
+    ret = total_errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+fini_threads:
+    for ( unsigned i = 0; i < inited; i++ ) bench_thread_fini(&bts[i]);
+    free(bts);
+destroy_server:
+    server_destroy(server);
+    rcmem_pool_trim();
+    exit(ret);
+}
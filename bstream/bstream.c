@@ -1,18 +1,40 @@
 #include "bstream.h"
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "list.h"
+#include "rcmem.h"
 #include "utils.h"
 
+#if _POSIX_C_SOURCE >= 1
+    #include <sys/types.h>
+#endif
+
 enum bstream_buffer_type {
     BSTREAM_BUFFER_BORROWED,
     BSTREAM_BUFFER_COPIED,
+    BSTREAM_BUFFER_RCMEM,   // Borrowed from rcmem, the buffer holds a reference until it's drained
+#if _POSIX_C_SOURCE >= 1
+    BSTREAM_BUFFER_FILE,   // A range of a borrowed fd, it isn't in memory at all
+#endif
     BSTREAM_BUFFER_TYPES_NR
 };
 
-#define BSTREAM_BUFFER_COPIED_SIZE 256
+/*
+ * Copied buffers come in power of two sizes from BSTREAM_CHUNK_MIN to BSTREAM_CHUNK_MAX. A short write gets
+ * the smallest one, a long one gets a single chunk as big as the write up to the stream cap, and every new
+ * chunk of a stream is at least twice as big as the previous one
+ */
+#define BSTREAM_CHUNK_MIN ((size_t)64)
+#define BSTREAM_CHUNK_MAX ((size_t)1 << 20)
+#define BSTREAM_CHUNK_CLASSES 15   // log2(BSTREAM_CHUNK_MAX / BSTREAM_CHUNK_MIN) + 1
+#define BSTREAM_CHUNK_CAP_DEFAULT ((size_t)64 * 1024)
+#define BSTREAM_RECV_CHUNK_MAX ((size_t)4096)   // Receive chunks don't grow, a receive stream is never flushed
+
+#define BSTREAM_POOL_HIGH_WATER 256                   // Free borrowed nodes a thread keeps
+#define BSTREAM_POOL_CLASS_BYTES ((size_t)64 * 1024)   // Free payload bytes a thread keeps per copied chunk size
 
 struct bstream_buffer {
     union {
@@ -20,19 +42,30 @@ struct bstream_buffer {
             const void *borrowed_bytes;
             size_t offset;   // Already read bytes count
             size_t len;      // Available to read bytes count
-        } borrowed;
+        } borrowed;   // Also for rcmem buffers, borrowed_bytes is the rcmem block then
         struct bstream_buffer_copied {
             void *bytes;
             size_t offset;       // Already read bytes count
             size_t len;          // Available to read bytes count
             size_t free_space;   // Available to write bytes count
+            size_t size;
 
-            // offset + len + free_space == BSTREAM_BUFFER_COPIED_SIZE
+            // offset + len + free_space == size
         } copied;
+#if _POSIX_C_SOURCE >= 1
+        struct bstream_buffer_file {
+            int fd;
+            off_t offset;   // Of the next unread byte in the file
+            size_t len;     // Available to read bytes count
+        } file;
+#endif
     } buffer;
 
     enum bstream_buffer_type type;
 
+    bool zc_pending;   // A zerocopy send still references the bytes, see bstream_send_sock
+    unsigned zc_seq;   // Of the last such send
+
     struct list chain;
 };
 
@@ -41,6 +74,7 @@ typedef size_t (*bstream_buffer_read_t)(struct bstream_buffer *bb, bstream_write
 typedef bool (*bstream_buffer_readable_t)(struct bstream_buffer *bb);
 typedef bool (*bstream_buffer_writable_t)(struct bstream_buffer *bb);
 typedef void (*bstream_buffer_destroy_t)(struct bstream_buffer *bb);
+typedef const void *(*bstream_buffer_peek_t)(const struct bstream_buffer *bb, size_t *len);
 
 struct bstream_buffer_ops {
     bstream_buffer_write_t write;
@@ -48,24 +82,84 @@ struct bstream_buffer_ops {
     bstream_buffer_readable_t readable;
     bstream_buffer_writable_t writable;
     bstream_buffer_destroy_t destroy;
+    bstream_buffer_peek_t peek;   // Readable bytes without reading them
 };
 
 
-static struct bstream_buffer *bstream_buffer_copied_create() {
-    struct bstream_buffer *bb = malloc(sizeof(struct bstream_buffer));
+/*
+ * Every question makes and drains buffers of the same few sizes, so drained buffers are kept in a per-thread pool
+ * instead of going back to malloc. A buffer can be freed on another thread than the one that made it, then it just
+ * moves to that thread's pool. Free buffers are chained through chain.next
+ */
+struct bstream_pool {
+    struct bstream_buffer *copied[BSTREAM_CHUNK_CLASSES];   // With their payload, by chunk size
+    size_t copied_nr[BSTREAM_CHUNK_CLASSES];
+    struct bstream_buffer *borrowed;
+    size_t borrowed_nr;
+};
+
+static __thread struct bstream_pool bstream_pool;
+
+static struct bstream_buffer *bstream_pool_pop(struct bstream_buffer **head, size_t *nr) {
+    struct bstream_buffer *bb = *head;
     if ( bb == NULL ) return NULL;
 
-    list_init(bb, chain);
-    bb->type = BSTREAM_BUFFER_COPIED;
+    *head = list_get_next(bb, chain);
+    (*nr)--;
+    return bb;
+}
 
-    struct bstream_buffer_copied *bbc = &bb->buffer.copied;
-    bbc->bytes = malloc(BSTREAM_BUFFER_COPIED_SIZE);
-    if ( bbc->bytes == NULL ) {
+static void bstream_pool_push(struct bstream_buffer **head, size_t *nr, size_t high_water, struct bstream_buffer *bb) {
+    if ( *nr >= high_water ) {
         free(bb);
-        return NULL;
+        return;
     }
 
-    bbc->free_space = BSTREAM_BUFFER_COPIED_SIZE;
+    bb->chain.prev = NULL;
+    bb->chain.next = *head == NULL ? NULL : &(*head)->chain;
+    *head = bb;
+    (*nr)++;
+}
+
+static void bstream_pool_trim_list(struct bstream_buffer **head, size_t *nr, size_t keep) {
+    while ( *nr > keep ) free(bstream_pool_pop(head, nr));
+}
+
+void bstream_pool_trim(size_t keep) {
+    for ( unsigned i = 0; i < BSTREAM_CHUNK_CLASSES; i++ )
+        bstream_pool_trim_list(&bstream_pool.copied[i], &bstream_pool.copied_nr[i], keep);
+    bstream_pool_trim_list(&bstream_pool.borrowed, &bstream_pool.borrowed_nr, keep);
+}
+
+// Smallest chunk class that holds size bytes, size must not exceed BSTREAM_CHUNK_MAX
+static unsigned bstream_chunk_class(size_t size) {
+    unsigned class = 0;
+    while ( (BSTREAM_CHUNK_MIN << class) < size ) class++;
+    assert(class < BSTREAM_CHUNK_CLASSES);
+    return class;
+}
+
+static size_t bstream_pool_class_high_water(unsigned class) {
+    return BSTREAM_POOL_CLASS_BYTES / (BSTREAM_CHUNK_MIN << class);   // Chunks above it aren't kept at all
+}
+
+static struct bstream_buffer *bstream_buffer_copied_create(size_t size) {
+    unsigned class = bstream_chunk_class(size);
+    size = BSTREAM_CHUNK_MIN << class;
+
+    // The node and its payload are one allocation, so a short write costs one small block
+    struct bstream_buffer *bb = bstream_pool_pop(&bstream_pool.copied[class], &bstream_pool.copied_nr[class]);
+    if ( bb == NULL ) bb = malloc(sizeof(struct bstream_buffer) + size);
+    if ( bb == NULL ) return NULL;
+
+    list_init(bb, chain);
+    bb->type = BSTREAM_BUFFER_COPIED;
+    bb->zc_pending = false;
+
+    struct bstream_buffer_copied *bbc = &bb->buffer.copied;
+    bbc->bytes = bb + 1;
+    bbc->size = size;
+    bbc->free_space = size;
     bbc->len = 0;
     bbc->offset = 0;
 
@@ -73,11 +167,13 @@ static struct bstream_buffer *bstream_buffer_copied_create() {
 }
 
 static struct bstream_buffer *bstream_buffer_borrowed_create(const void *data, size_t len) {
-    struct bstream_buffer *bb = malloc(sizeof(struct bstream_buffer));
+    struct bstream_buffer *bb = bstream_pool_pop(&bstream_pool.borrowed, &bstream_pool.borrowed_nr);
+    if ( bb == NULL ) bb = malloc(sizeof(struct bstream_buffer));
     if ( bb == NULL ) return NULL;
 
     list_init(bb, chain);
     bb->type = BSTREAM_BUFFER_BORROWED;
+    bb->zc_pending = false;
 
     struct bstream_buffer_borrowed *bbb = &bb->buffer.borrowed;
     bbb->len = len;
@@ -92,12 +188,21 @@ static size_t bstream_buffer_copied_read(struct bstream_buffer *bb, bstream_writ
 static bool bstream_buffer_copied_writable(struct bstream_buffer *bb);
 static bool bstream_buffer_copied_readable(struct bstream_buffer *bb);
 static void bstream_buffer_copied_destroy(struct bstream_buffer *bb);
+static const void *bstream_buffer_copied_peek(const struct bstream_buffer *bb, size_t *len);
 
 static size_t bstream_buffer_borrowed_write(struct bstream_buffer *bb, bstream_reader_t reader, void *arg, size_t len);
 static size_t bstream_buffer_borrowed_read(struct bstream_buffer *bb, bstream_writer_t writer, void *arg, size_t len);
 static bool bstream_buffer_borrowed_writable(struct bstream_buffer *bb);
 static bool bstream_buffer_borrowed_readable(struct bstream_buffer *bb);
 static void bstream_buffer_borrowed_destroy(struct bstream_buffer *bb);
+static const void *bstream_buffer_borrowed_peek(const struct bstream_buffer *bb, size_t *len);
+
+static void bstream_buffer_rcmem_destroy(struct bstream_buffer *bb);
+
+#if _POSIX_C_SOURCE >= 1
+static size_t bstream_buffer_file_read(struct bstream_buffer *bb, bstream_writer_t writer, void *arg, size_t len);
+static bool bstream_buffer_file_readable(struct bstream_buffer *bb);
+#endif
 
 static struct bstream_buffer_ops bbops[BSTREAM_BUFFER_TYPES_NR] = {
     [BSTREAM_BUFFER_COPIED] =
@@ -106,15 +211,35 @@ static struct bstream_buffer_ops bbops[BSTREAM_BUFFER_TYPES_NR] = {
             .read = bstream_buffer_copied_read,
             .writable = bstream_buffer_copied_writable,
             .readable = bstream_buffer_copied_readable,
-            .destroy = bstream_buffer_copied_destroy  
+            .destroy = bstream_buffer_copied_destroy,
+            .peek = bstream_buffer_copied_peek
         },
     [BSTREAM_BUFFER_BORROWED] = {
             .write = bstream_buffer_borrowed_write,
             .read = bstream_buffer_borrowed_read,
             .writable = bstream_buffer_borrowed_writable,
             .readable = bstream_buffer_borrowed_readable,
-            .destroy = bstream_buffer_borrowed_destroy
+            .destroy = bstream_buffer_borrowed_destroy,
+            .peek = bstream_buffer_borrowed_peek
+    },
+    [BSTREAM_BUFFER_RCMEM] = {
+            .write = bstream_buffer_borrowed_write,
+            .read = bstream_buffer_borrowed_read,
+            .writable = bstream_buffer_borrowed_writable,
+            .readable = bstream_buffer_borrowed_readable,
+            .destroy = bstream_buffer_rcmem_destroy,
+            .peek = bstream_buffer_borrowed_peek
+    },
+#if _POSIX_C_SOURCE >= 1
+    [BSTREAM_BUFFER_FILE] = {
+            .write = bstream_buffer_borrowed_write,
+            .read = bstream_buffer_file_read,
+            .writable = bstream_buffer_borrowed_writable,
+            .readable = bstream_buffer_file_readable,
+            .destroy = bstream_buffer_borrowed_destroy,   // Same node size, the fd stays with its owner
+            .peek = NULL   // Nothing to peek, bstream_read_fd sends it with sendfile
     }
+#endif
 };
 
 static size_t bstream_buffer_write(struct bstream_buffer *bb, bstream_reader_t reader, void *arg, size_t len) {
@@ -137,6 +262,21 @@ static void bstream_buffer_destroy(struct bstream_buffer *bb) {
     return bbops[bb->type].destroy(bb);
 }
 
+static const void *bstream_buffer_peek(const struct bstream_buffer *bb, size_t *len) {
+    return bbops[bb->type].peek(bb, len);
+}
+
+// The buffer left the stream. If a zerocopy send still references it, it waits for the completion
+static void bstream_buffer_retire(struct bstream *bs, struct bstream_buffer *bb) {
+    if ( !bb->zc_pending ) {
+        bstream_buffer_destroy(bb);
+        return;
+    }
+
+    list_init(bb, chain);
+    list_add_item_back(&bs->zc_head, &bs->zc_tail, bb, chain);
+}
+
 
 static size_t bstream_buffer_copied_write(struct bstream_buffer *bb, bstream_reader_t reader, void *arg, size_t len) {
     if ( !bstream_buffer_copied_writable(bb) ) return 0;
@@ -150,7 +290,7 @@ static size_t bstream_buffer_copied_write(struct bstream_buffer *bb, bstream_rea
     bbc->free_space -= written;
     bbc->len += written;
 
-    assert(bbc->len + bbc->offset + bbc->free_space == BSTREAM_BUFFER_COPIED_SIZE);
+    assert(bbc->len + bbc->offset + bbc->free_space == bbc->size);
 
     return written;
 }
@@ -165,7 +305,7 @@ static size_t bstream_buffer_copied_read(struct bstream_buffer *bb, bstream_writ
     bbc->offset += read;
     bbc->len -= read;
 
-    assert(bbc->len + bbc->offset + bbc->free_space == BSTREAM_BUFFER_COPIED_SIZE);
+    assert(bbc->len + bbc->offset + bbc->free_space == bbc->size);
 
     return read;
 }
@@ -182,9 +322,16 @@ static bool bstream_buffer_copied_readable(struct bstream_buffer *bb) {
 }
 
 static void bstream_buffer_copied_destroy(struct bstream_buffer *bb) {
-    struct bstream_buffer_copied *bbc = &bb->buffer.copied;
-    free(bbc->bytes);
-    free(bb);
+    unsigned class = bstream_chunk_class(bb->buffer.copied.size);
+    bstream_pool_push(
+        &bstream_pool.copied[class], &bstream_pool.copied_nr[class], bstream_pool_class_high_water(class), bb
+    );
+}
+
+static const void *bstream_buffer_copied_peek(const struct bstream_buffer *bb, size_t *len) {
+    const struct bstream_buffer_copied *bbc = &bb->buffer.copied;
+    *len = bbc->len;
+    return shiftptr(bbc->bytes, bbc->offset);
 }
 
 static size_t bstream_buffer_borrowed_write(struct bstream_buffer *bb, bstream_reader_t reader, void *arg, size_t len) {
@@ -221,21 +368,58 @@ static bool bstream_buffer_borrowed_readable(struct bstream_buffer *bb) {
 }
 
 static void bstream_buffer_borrowed_destroy(struct bstream_buffer *bb) {
-    free(bb);
+    bstream_pool_push(&bstream_pool.borrowed, &bstream_pool.borrowed_nr, BSTREAM_POOL_HIGH_WATER, bb);
 }
 
-struct bstream {
-    struct bstream_buffer *head;
-    struct bstream_buffer *tail;
-    size_t total_len;
-};
+static const void *bstream_buffer_borrowed_peek(const struct bstream_buffer *bb, size_t *len) {
+    const struct bstream_buffer_borrowed *bbb = &bb->buffer.borrowed;
+    *len = bbb->len;
+    return shiftptr(bbb->borrowed_bytes, bbb->offset);
+}
+
+static void bstream_buffer_rcmem_destroy(struct bstream_buffer *bb) {
+    rcmem_put((void *)bb->buffer.borrowed.borrowed_bytes);   // offset moves, the block pointer doesn't
+    bstream_buffer_borrowed_destroy(bb);
+}
+
+#if _POSIX_C_SOURCE >= 1
+    #include <unistd.h>
+
+    #define BSTREAM_FILE_READ_CHUNK 4096
+
+// Only for sinks that aren't fds, the bytes go through a stack buffer then
+static size_t bstream_buffer_file_read(struct bstream_buffer *bb, bstream_writer_t writer, void *arg, size_t len) {
+    struct bstream_buffer_file *bbf = &bb->buffer.file;
+
+    size_t read = 0;
+    while ( read < len && bbf->len > 0 ) {
+        char chunk[BSTREAM_FILE_READ_CHUNK];
+        size_t want = min(min(len - read, bbf->len), sizeof(chunk));
+
+        ssize_t res = pread(bbf->fd, chunk, want, bbf->offset);
+        if ( res <= 0 ) break;
+
+        size_t written = writer(arg, chunk, res);
+        bbf->offset += written;
+        bbf->len -= written;
+        read += written;
+
+        if ( written < (size_t)res ) break;
+    }
+
+    return read;
+}
+
+static bool bstream_buffer_file_readable(struct bstream_buffer *bb) {
+    return bb->buffer.file.len > 0;
+}
+#endif
 
 struct bstream *bstream_create() {
     struct bstream *bs = malloc(sizeof(struct bstream));
     if ( bs == NULL ) return NULL;
 
-    list_init_head_tail(bs, head, tail);
-    bs->total_len = 0;
+    bstream_init(bs);
 
     return bs;
 }
@@ -243,13 +427,54 @@ struct bstream *bstream_create() {
 void bstream_destroy(struct bstream *bs) {
     assert(bs);
 
-    if ( bs->head != NULL ) {
-        list_foreach_safe(bs->head, chain, iter) {
-            if ( iter->type == BSTREAM_BUFFER_COPIED ) free(iter->buffer.copied.bytes);
-            free(iter);
+    bstream_fini(bs);
+    free(bs);
+}
+
+void bstream_init(struct bstream *bs) {
+    assert(bs);
+
+    list_init_head_tail(bs, head, tail);
+    bs->total_len = 0;
+    bs->chunk_next = BSTREAM_CHUNK_MIN;
+    bs->chunk_cap = BSTREAM_CHUNK_CAP_DEFAULT;
+
+    list_init_head_tail(bs, zc_head, zc_tail);
+    bs->zc_min = 0;
+    bs->zc_seq = 0;
+}
+
+bool bstream_zerocopy_pending(const struct bstream *bs) {
+    return bs->zc_head != NULL;
+}
+
+void bstream_fini(struct bstream *bs) {
+    bstream_flush(bs);
+
+    // Pinned pages don't stop the memory from being reused, the caller has aborted the connection already
+    if ( bs->zc_head != NULL ) {
+        list_foreach_safe(bs->zc_head, chain, iter) {
+            bstream_buffer_destroy(iter);
         }
     }
-    free(bs);
+    list_init_head_tail(bs, zc_head, zc_tail);
+}
+
+void bstream_set_chunk_cap(struct bstream *bs, size_t cap) {
+    assert(bs);
+
+    if ( cap < BSTREAM_CHUNK_MIN ) cap = BSTREAM_CHUNK_MIN;
+    if ( cap > BSTREAM_CHUNK_MAX ) cap = BSTREAM_CHUNK_MAX;
+    bs->chunk_cap = cap;
+}
+
+// Size of a new chunk for a write with remain bytes left
+static size_t bstream_next_chunk_size(struct bstream *bs, size_t remain) {
+    size_t size = max(remain, bs->chunk_next);
+    size = min(size, bs->chunk_cap);
+
+    bs->chunk_next = min(size * 2, bs->chunk_cap);
+    return size;
 }
 
 size_t bstream_write_borrow(struct bstream *bs, const void *buf, size_t len) {
@@ -266,6 +491,44 @@ size_t bstream_write_borrow(struct bstream *bs, const void *buf, size_t len) {
     return len;
 }
 
+size_t bstream_write_rcmem(struct bstream *bs, void *mem, size_t len) {
+    size_t new_total_len = bs->total_len;
+    if ( ckd_add(&new_total_len, new_total_len, len) ) return 0;
+
+    struct bstream_buffer *bb = bstream_buffer_borrowed_create(mem, len);
+    if ( bb == NULL ) return 0;
+
+    bb->type = BSTREAM_BUFFER_RCMEM;
+    rcmem_take(mem);
+
+    list_add_item_back(&bs->head, &bs->tail, bb, chain);
+
+    bs->total_len = new_total_len;
+
+    return len;
+}
+
+#if _POSIX_C_SOURCE >= 1
+size_t bstream_write_file(struct bstream *bs, int fd, off_t offset, size_t len) {
+    size_t new_total_len = bs->total_len;
+    if ( ckd_add(&new_total_len, new_total_len, len) ) return 0;
+
+    struct bstream_buffer *bb = bstream_buffer_borrowed_create(NULL, 0);
+    if ( bb == NULL ) return 0;
+
+    bb->type = BSTREAM_BUFFER_FILE;
+    bb->buffer.file.fd = fd;
+    bb->buffer.file.offset = offset;
+    bb->buffer.file.len = len;
+
+    list_add_item_back(&bs->head, &bs->tail, bb, chain);
+
+    bs->total_len = new_total_len;
+
+    return len;
+}
+#endif
+
 size_t bstream_write(struct bstream *bs, bstream_reader_t reader, void *arg, size_t len) {
     size_t new_total_len = bs->total_len;
     if ( ckd_add(&new_total_len, new_total_len, len) ) return 0;   // Check overflow
@@ -278,6 +541,7 @@ size_t bstream_write(struct bstream *bs, bstream_reader_t reader, void *arg, siz
             // The last buffer can be writable for two reasons:
             // 1. All the data was stored there
             // 2. Reader error occured
+            bs->total_len += written;
             return written;
         }
     }
@@ -285,7 +549,7 @@ size_t bstream_write(struct bstream *bs, bstream_reader_t reader, void *arg, siz
     size_t remain = len - written;
 
     while ( true ) {
-        struct bstream_buffer *bb = bstream_buffer_copied_create();
+        struct bstream_buffer *bb = bstream_buffer_copied_create(bstream_next_chunk_size(bs, remain));
         if ( bb == NULL ) {
             bs->total_len += written;
             return written;
@@ -322,8 +586,6 @@ size_t bstream_fpreader(void *dest, void *arg, size_t len) {
 }
 
 #if _POSIX_C_SOURCE >= 1
-    #include <unistd.h>
-
 size_t bstream_fdreader(void *dest, void *arg, size_t len) {
     int fd = *(int *)arg;
     ssize_t written = read(fd, dest, len);
@@ -385,12 +647,13 @@ size_t bstream_read(struct bstream *bs, bstream_writer_t writer, void *arg, size
             }
 
             list_remove_item(&bs->head, &bs->tail, iter, chain);
-            bstream_buffer_destroy(iter);
+            bstream_buffer_retire(bs, iter);
 
             if ( res == remain ) {
                 bs->total_len -= read;
                 return read;
             }
+            remain -= res;
         }
     }
 
@@ -406,12 +669,437 @@ size_t bstream_read_fp(struct bstream *bs, FILE *fp, size_t len) {
     return bstream_read(bs, bstream_fpwriter, fp, len);
 }
 
+/*
+ * The chain walker of bstream_get_iov and bstream_peek_spans: the first non-empty segment from bb on, NULL at
+ * the end or at a segment that isn't in memory, the segments after it have to wait
+ */
+static struct bstream_buffer *bstream_segment_from(struct bstream_buffer *bb, const void **data, size_t *len) {
+    for ( ; bb != NULL; bb = list_get_next(bb, chain) ) {
+        if ( bbops[bb->type].peek == NULL ) return NULL;
+
+        *data = bstream_buffer_peek(bb, len);
+        if ( *len != 0 ) return bb;
+    }
+
+    return NULL;
+}
+
+#define bstream_foreach_segment(bs, iter, data, len) \
+    for ( struct bstream_buffer *iter = bstream_segment_from((bs)->head, &(data), &(len)); iter != NULL; \
+          iter = bstream_segment_from(list_get_next(iter, chain), &(data), &(len)) )
+
 #if _POSIX_C_SOURCE >= 1
+    #include <netinet/in.h>
+    #include <sys/sendfile.h>
+    #include <sys/socket.h>
+    #include <sys/uio.h>
+    #ifdef MSG_ZEROCOPY
+        #include <linux/errqueue.h>
+    #endif
+
+    #define BSTREAM_IOV_MAX 64   // Segments per writev, a question is only a couple of them
+
+// The head is a file buffer, sends it from the page cache. Returns what sendfile returned
+static ssize_t bstream_send_file(struct bstream *bs, int fd, size_t len) {
+    struct bstream_buffer *bb = bs->head;
+    struct bstream_buffer_file *bbf = &bb->buffer.file;
+
+    ssize_t res = sendfile(fd, bbf->fd, &bbf->offset, min(len, bbf->len));   // Updates offset by itself
+    if ( res <= 0 ) return res;
+
+    bbf->len -= res;
+    bs->total_len -= res;
+
+    if ( bbf->len == 0 ) {
+        list_remove_item(&bs->head, &bs->tail, bb, chain);
+        bstream_buffer_destroy(bb);
+    }
+
+    return res;
+}
+
+// Cuts the segments down to len bytes, returns their total
+static size_t bstream_trim_iov(struct iovec *iov, int *iovcnt, size_t len) {
+    size_t total = 0;
+    for ( int i = 0; i < *iovcnt; i++ ) {
+        size_t left = len - total;
+        if ( iov[i].iov_len >= left ) {
+            iov[i].iov_len = left;
+            *iovcnt = i + 1;
+        }
+        total += iov[i].iov_len;
+    }
+
+    return total;
+}
+
 size_t bstream_read_fd(struct bstream *bs, int fd, size_t len) {
-    return bstream_read(bs, bstream_fdwriter, &fd, len);
+    size_t sent = 0;
+
+    while ( sent < len ) {
+        if ( bs->head != NULL && bs->head->type == BSTREAM_BUFFER_FILE ) {
+            size_t want = min(len - sent, bs->head->buffer.file.len);
+            ssize_t written = bstream_send_file(bs, fd, want);
+            if ( written <= 0 ) break;
+            sent += written;
+
+            if ( (size_t)written < want ) break;   // The fd is full or the file is shorter than promised
+            continue;
+        }
+
+        struct iovec iov[BSTREAM_IOV_MAX];
+        int iovcnt = bstream_get_iov(bs, iov, BSTREAM_IOV_MAX);
+        if ( iovcnt == 0 ) break;
+
+        size_t want = bstream_trim_iov(iov, &iovcnt, len - sent);
+
+        ssize_t written = writev(fd, iov, iovcnt);
+        if ( written <= 0 ) break;
+
+        bstream_consume(bs, written);
+        sent += written;
+
+        if ( (size_t)written < want ) break;   // The fd is full, no sense to try again right now
+    }
+
+    return sent;
+}
+
+#ifdef MSG_ZEROCOPY
+// Only these can wait for a completion, borrowed memory may be gone as soon as it's drained
+static bool bstream_buffer_owned(const struct bstream_buffer *bb) {
+    return bb->type == BSTREAM_BUFFER_COPIED || bb->type == BSTREAM_BUFFER_RCMEM;
+}
+
+// Leaves only the owned run from the head in iov. Returns its length if it's worth a zerocopy send, 0 otherwise
+static size_t bstream_zerocopy_run(const struct bstream *bs, struct iovec *iov, int *iovcnt) {
+    int owned = 0;
+    size_t owned_len = 0;
+
+    struct bstream_buffer *head = bs->head;
+    list_foreach(head, chain, iter) {   // get_iov skips empty segments the same way
+        if ( owned == *iovcnt ) break;
+
+        size_t len;
+        if ( bbops[iter->type].peek == NULL ) break;
+        bstream_buffer_peek(iter, &len);
+        if ( len == 0 ) continue;
+        if ( !bstream_buffer_owned(iter) ) break;
+
+        owned_len += iov[owned].iov_len;
+        owned++;
+    }
+
+    if ( owned_len < bs->zc_min ) return 0;
+
+    *iovcnt = owned;
+    return owned_len;
+}
+
+// The first len bytes went out with zerocopy send seq
+static void bstream_mark_zerocopy(struct bstream *bs, size_t len, unsigned seq) {
+    struct bstream_buffer *head = bs->head;
+    list_foreach(head, chain, iter) {
+        if ( len == 0 ) break;
+
+        size_t seg_len;
+        bstream_buffer_peek(iter, &seg_len);
+        if ( seg_len == 0 ) continue;
+
+        iter->zc_pending = true;
+        iter->zc_seq = seq;
+        len -= min(len, seg_len);
+    }
+}
+
+// The kernel is done with zerocopy sends lo..hi
+static void bstream_complete_zerocopy(struct bstream *bs, unsigned lo, unsigned hi) {
+    if ( bs->zc_head != NULL ) {
+        list_foreach_safe(bs->zc_head, chain, iter) {
+            if ( iter->zc_seq - lo > hi - lo ) continue;   // Wraps like the kernel counter
+
+            list_remove_item(&bs->zc_head, &bs->zc_tail, iter, chain);
+            bstream_buffer_destroy(iter);
+        }
+    }
+
+    // A partly sent buffer is still in the stream, TCP completes in order, so a later send can't be done yet
+    struct bstream_buffer *head = bs->head;
+    list_foreach(head, chain, iter) {
+        if ( iter->zc_pending && iter->zc_seq - lo <= hi - lo ) iter->zc_pending = false;
+    }
+}
+#endif
+
+void bstream_set_zerocopy(struct bstream *bs, size_t min) {
+    assert(bs);
+    bs->zc_min = min;
+}
+
+enum bstream_send_res bstream_send_sock(struct bstream *bs, int sockfd, size_t len, size_t *sent) {
+    assert(bs);
+    assert(sent);
+
+    *sent = 0;
+    while ( *sent < len ) {
+        ssize_t written;
+        size_t want;
+
+        if ( bs->head != NULL && bs->head->type == BSTREAM_BUFFER_FILE ) {
+            want = min(len - *sent, bs->head->buffer.file.len);
+            written = bstream_send_file(bs, sockfd, want);
+            if ( written == 0 ) {   // The file is shorter than promised, the stream can't go on
+                errno = EIO;
+                return BSTREAM_SEND_ERROR;
+            }
+        } else {
+            struct iovec iov[BSTREAM_IOV_MAX];
+            int iovcnt = bstream_get_iov(bs, iov, BSTREAM_IOV_MAX);
+            if ( iovcnt == 0 ) break;
+
+            want = bstream_trim_iov(iov, &iovcnt, len - *sent);
+            int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+
+#ifdef MSG_ZEROCOPY
+            if ( bs->zc_min != 0 ) {
+                size_t run = bstream_zerocopy_run(bs, iov, &iovcnt);
+                if ( run != 0 ) {
+                    want = run;
+                    flags |= MSG_ZEROCOPY;
+                }
+            }
+#endif
+
+            struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+            written = sendmsg(sockfd, &msg, flags);
+
+#ifdef MSG_ZEROCOPY
+            if ( written == -1 && errno == ENOBUFS && (flags & MSG_ZEROCOPY) ) {   // Out of optmem for pinned pages
+                flags &= ~MSG_ZEROCOPY;
+                written = sendmsg(sockfd, &msg, flags);
+            }
+
+            if ( written >= 0 && (flags & MSG_ZEROCOPY) ) bstream_mark_zerocopy(bs, written, bs->zc_seq++);
+#endif
+
+            if ( written > 0 ) bstream_consume(bs, written);
+        }
+
+        if ( written == -1 ) {
+            if ( errno == EINTR ) continue;
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) return BSTREAM_SEND_AGAIN;
+            return BSTREAM_SEND_ERROR;
+        }
+
+        *sent += written;
+        if ( (size_t)written < want ) return BSTREAM_SEND_AGAIN;   // The socket is full
+    }
+
+    return BSTREAM_SEND_DONE;
+}
+
+int bstream_reap_zerocopy(struct bstream *bs, int sockfd) {
+    assert(bs);
+
+#ifdef MSG_ZEROCOPY
+    while ( true ) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr msg = {.msg_control = control, .msg_controllen = sizeof(control)};
+
+        if ( recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1 ) {
+            if ( errno == EINTR ) continue;
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) return 0;
+            return -1;
+        }
+
+        for ( struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm) ) {
+            bool recverr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                           (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+            if ( !recverr ) continue;
+
+            struct sock_extended_err serr;
+            memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+            if ( serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr.ee_errno != 0 ) {
+                errno = serr.ee_errno != 0 ? (int)serr.ee_errno : EIO;
+                return -1;
+            }
+
+            // The kernel had to copy anyway (loopback, a NIC without scatter-gather), completions only cost then
+            if ( serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED ) bs->zc_min = 0;
+            bstream_complete_zerocopy(bs, serr.ee_info, serr.ee_data);
+        }
+    }
+#else
+    unused(sockfd);
+    return 0;
+#endif
+}
+
+size_t bstream_recv_fd(struct bstream *bs, int fd, size_t len) {
+    assert(bs);
+
+    size_t new_total_len = bs->total_len;
+    if ( ckd_add(&new_total_len, new_total_len, len) ) return 0;
+
+    struct iovec iov[2];
+    int iovcnt = 0;
+
+    // The free space of the last chunk first, then a fresh one for the rest
+    struct bstream_buffer *tail = bs->tail;
+    size_t tail_space = 0;
+    if ( tail != NULL && tail->type == BSTREAM_BUFFER_COPIED && bstream_buffer_copied_writable(tail) ) {
+        struct bstream_buffer_copied *bbc = &tail->buffer.copied;
+        tail_space = min(len, bbc->free_space);
+        iov[iovcnt].iov_base = shiftptr(bbc->bytes, bbc->offset + bbc->len);
+        iov[iovcnt].iov_len = tail_space;
+        iovcnt++;
+    }
+
+    struct bstream_buffer *bb = NULL;
+    if ( tail_space < len ) {
+        bb = bstream_buffer_copied_create(min(len - tail_space, BSTREAM_RECV_CHUNK_MAX));
+        if ( bb != NULL ) {
+            iov[iovcnt].iov_base = bb->buffer.copied.bytes;
+            iov[iovcnt].iov_len = min(len - tail_space, bb->buffer.copied.free_space);
+            iovcnt++;
+        }
+    }
+
+    if ( iovcnt == 0 ) return 0;
+
+    errno = 0;
+    ssize_t res = readv(fd, iov, iovcnt);
+    if ( res <= 0 ) {
+        int saved_errno = errno;
+        if ( bb != NULL ) bstream_buffer_destroy(bb);
+        errno = saved_errno;
+        return 0;
+    }
+
+    size_t got = res;
+    size_t in_tail = min(got, tail_space);
+    if ( in_tail != 0 ) {
+        tail->buffer.copied.len += in_tail;
+        tail->buffer.copied.free_space -= in_tail;
+    }
+
+    if ( bb != NULL ) {
+        if ( got > in_tail ) {
+            bb->buffer.copied.len = got - in_tail;
+            bb->buffer.copied.free_space -= got - in_tail;
+            list_add_item_back(&bs->head, &bs->tail, bb, chain);
+        } else {
+            bstream_buffer_destroy(bb);   // Back to the pool, the next receive takes it again
+        }
+    }
+
+    bs->total_len += got;
+    return got;
+}
+
+int bstream_get_iov(const struct bstream *bs, struct iovec *iov, int iovcnt) {
+    assert(bs);
+
+    int filled = 0;
+    const void *data;
+    size_t len;
+    bstream_foreach_segment(bs, iter, data, len) {
+        if ( filled == iovcnt ) break;
+
+        iov[filled].iov_base = (void *)data;
+        iov[filled].iov_len = len;
+        filled++;
+    }
+
+    return filled;
 }
 #endif
 
+size_t bstream_peek_spans(const struct bstream *bs, struct bstream_span *spans, size_t nr) {
+    assert(bs);
+
+    size_t filled = 0;
+    const void *data;
+    size_t len;
+    bstream_foreach_segment(bs, iter, data, len) {
+        if ( filled == nr ) break;
+
+        spans[filled].data = data;
+        spans[filled].len = len;
+        filled++;
+    }
+
+    return filled;
+}
+
+bool bstream_find_delim(const struct bstream *bs, int delim, size_t *offset) {
+    assert(bs);
+    assert(offset);
+
+    size_t scanned = 0;
+    struct bstream_buffer *head = bs->head;
+    list_foreach(head, chain, iter) {
+        if ( bbops[iter->type].peek == NULL ) return false;   // Can't look into file ranges
+
+        size_t len;
+        const char *data = bstream_buffer_peek(iter, &len);
+        if ( len == 0 ) continue;
+
+        // libc memchr already compares a vector register at a time
+        const char *found = memchr(data, delim, len);
+        if ( found != NULL ) {
+            *offset = scanned + (found - data);
+            return true;
+        }
+
+        scanned += len;
+    }
+
+    return false;
+}
+
+const char *bstream_peek_line(struct bstream *bs, size_t *len) {
+    assert(bs);
+    assert(len);
+
+    size_t delim_offset;
+    if ( !bstream_find_delim(bs, '\n', &delim_offset) ) return NULL;
+    size_t line_len = delim_offset + 1;
+
+    size_t head_len;
+    const char *head_data = bstream_buffer_peek(bs->head, &head_len);
+    if ( head_len >= line_len ) {   // The usual case, the whole line is in the first segment
+        *len = line_len;
+        return head_data;
+    }
+
+    // The line is split between segments, gather it into one chunk in front of the rest
+    if ( line_len > BSTREAM_CHUNK_MAX ) return NULL;
+    struct bstream_buffer *bb = bstream_buffer_copied_create(line_len);
+    if ( bb == NULL ) return NULL;
+
+    void *dest = bb->buffer.copied.bytes;
+    bstream_read(bs, bstream_memwriter, &dest, line_len);
+    bb->buffer.copied.len = line_len;
+    bb->buffer.copied.free_space -= line_len;
+
+    list_add_item_front(&bs->head, &bs->tail, bb, chain);
+    bs->total_len += line_len;
+
+    *len = line_len;
+    return bb->buffer.copied.bytes;
+}
+
+static size_t bstream_nullwriter(void *arg, const void *src, size_t len) {
+    unused(arg);
+    unused(src);
+    return len;
+}
+
+size_t bstream_consume(struct bstream *bs, size_t len) {
+    return bstream_read(bs, bstream_nullwriter, NULL, len);
+}
+
 size_t bstream_len(const struct bstream *bs) {
     assert(bs);
     return bs->total_len;
@@ -421,12 +1109,13 @@ void bstream_flush(struct bstream *bs) {
     assert(bs);
     if ( bs->head != NULL ) {
         list_foreach_safe(bs->head, chain, iter) {
-            bstream_buffer_destroy(iter);
+            bstream_buffer_retire(bs, iter);
         }
     }
 
     list_init_head_tail(bs, head, tail);
     bs->total_len = 0;
+    bs->chunk_next = BSTREAM_CHUNK_MIN;
 }
 
 bool bstream_empty(const struct bstream *bs) {
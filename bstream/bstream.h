@@ -1,12 +1,32 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 
-struct bstream;
+struct bstream_buffer;
+
+// Public only to be embedded into other structs, use the functions below to touch it
+struct bstream {
+    struct bstream_buffer *head;
+    struct bstream_buffer *tail;
+    size_t total_len;
+    size_t chunk_next;   // Min size of the next copied chunk, it doubles with every chunk until the stream is flushed
+    size_t chunk_cap;
+
+    struct bstream_buffer *zc_head;   // Drained buffers the kernel still reads from, see bstream_send_sock
+    struct bstream_buffer *zc_tail;
+    size_t zc_min;                    // Zerocopy is off if 0
+    unsigned zc_seq;                  // Of the next zerocopy send on the socket
+};
 
 extern struct bstream *bstream_create();
 extern void bstream_destroy(struct bstream *bs);
+// The same for an embedded stream
+extern void bstream_init(struct bstream *bs);
+extern void bstream_fini(struct bstream *bs);
+// Max size of one copied chunk, 64 KiB by default, clamped to 64 B .. 1 MiB. Bigger chunks mean fewer segments
+extern void bstream_set_chunk_cap(struct bstream *bs, size_t cap);
 
 
 typedef size_t (*bstream_reader_t)(void *dest, void *arg, size_t len);
@@ -19,12 +39,21 @@ extern size_t bstream_fdreader(void *dest, void *arg, size_t len);
 #endif
 
 extern size_t bstream_write_borrow(struct bstream *bs, const void *buf, size_t len);
+// Like bstream_write_borrow, but mem is an rcmem block and the stream keeps its own reference until it drains it
+extern size_t bstream_write_rcmem(struct bstream *bs, void *mem, size_t len);
 extern size_t bstream_write(struct bstream *bs, bstream_reader_t reader, void *arg, size_t len);
 extern size_t bstream_write_mem(struct bstream *bs, const void *src, size_t len);
 extern size_t bstream_write_fp(struct bstream *bs, FILE *fp, size_t len);
 
 #if _POSIX_C_SOURCE >= 1
 extern size_t bstream_write_fd(struct bstream *bs, int fd, size_t len);
+
+    #include <sys/types.h>
+/*
+ * Queues len bytes of fd from offset without reading them. bstream_read_fd sends them with sendfile, other
+ * sinks get them through pread. The fd isn't duplicated, it has to stay open until the range is drained or flushed
+ */
+extern size_t bstream_write_file(struct bstream *bs, int fd, off_t offset, size_t len);
 #endif
 
 
@@ -43,9 +72,79 @@ extern size_t bstream_read_mem(struct bstream *bs, void *dest, size_t len);
 extern size_t bstream_read_fp(struct bstream *bs, FILE *fp, size_t len);
 
 #if _POSIX_C_SOURCE >= 1
+// Gathers the segments into one writev and consumes exactly what the kernel accepted
 extern size_t bstream_read_fd(struct bstream *bs, int fd, size_t len);
 #endif
 
 
+#if _POSIX_C_SOURCE >= 1
+struct iovec;
+// Fills up to iovcnt entries with the readable segments from the head, returns the filled count. Nothing is consumed,
+// the segments stay valid until the stream is changed. It stops at a file range, those aren't in memory
+extern int bstream_get_iov(const struct bstream *bs, struct iovec *iov, int iovcnt);
+#endif
+#if _POSIX_C_SOURCE >= 1
+enum bstream_send_res {
+    BSTREAM_SEND_DONE,    // len bytes or the whole stream went out
+    BSTREAM_SEND_AGAIN,   // The socket is full, wait until it's writable
+    BSTREAM_SEND_ERROR    // errno tells what happened, the connection is unusable
+};
+
+/*
+ * Sends up to len bytes to a nonblocking socket and consumes what the kernel accepted, *sent gets its count.
+ * Unlike bstream_read_fd it tells a full socket apart from a failure
+ */
+extern enum bstream_send_res bstream_send_sock(struct bstream *bs, int sockfd, size_t len, size_t *sent);
+/*
+ * Runs of at least min bytes of the stream's own memory go out with MSG_ZEROCOPY then, the socket must have
+ * SO_ZEROCOPY. Drained buffers wait for their completions, call bstream_reap_zerocopy on EPOLLERR. 0 turns it off
+ */
+extern void bstream_set_zerocopy(struct bstream *bs, size_t min);
+// Frees the buffers whose zerocopy sends are complete. -1 with errno if the error queue had a real socket error
+extern int bstream_reap_zerocopy(struct bstream *bs, int sockfd);
+/*
+ * Some drained buffers still wait for their completions. The kernel may transmit from them until then, so the
+ * socket has to be aborted (SO_LINGER with zero timeout) and closed before bstream_fini frees them
+ */
+extern bool bstream_zerocopy_pending(const struct bstream *bs);
+
+/*
+ * Receive side: one readv from fd into the free space of the last chunk and a new one of at most 4 KiB, up to len
+ * bytes. Drained chunks come back from the thread pool, so a stream that is read from and consumed cycles through
+ * the same few.
+ * Returns 0 on EOF or error, errno is 0 on EOF
+ */
+extern size_t bstream_recv_fd(struct bstream *bs, int fd, size_t len);
+#endif
+
+struct bstream_span {
+    const void *data;
+    size_t len;
+};
+
+/*
+ * Fills up to nr spans with the readable segments from the head and returns the filled count, without consuming
+ * anything or calling back per segment. Stops at a file range. The spans stay valid until the stream is changed,
+ * drop what was used with bstream_consume
+ */
+extern size_t bstream_peek_spans(const struct bstream *bs, struct bstream_span *spans, size_t nr);
+
+// Offset of the first delim byte from the head. False if there is none before the end or a file range
+extern bool bstream_find_delim(const struct bstream *bs, int delim, size_t *offset);
+/*
+ * The first line with its '\n' as one span, NULL if there is no whole line yet. A line split between segments
+ * is gathered into one chunk first. The span is valid until the stream is changed, consume it when done
+ */
+extern const char *bstream_peek_line(struct bstream *bs, size_t *len);
+
+// Drops up to len bytes from the head, e.g. the ones the kernel accepted from bstream_get_iov segments
+extern size_t bstream_consume(struct bstream *bs, size_t len);
+
+/*
+ * Drained buffers stay in a pool of the thread that drained them, up to a high-water mark. Trims the pool
+ * of the calling thread to keep buffers of each kind. Threads that used bstreams call it with 0 before they exit
+ */
+extern void bstream_pool_trim(size_t keep);
+
 extern size_t bstream_len(const struct bstream *bs);
 extern void bstream_flush(struct bstream *bs);
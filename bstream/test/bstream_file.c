@@ -0,0 +1,84 @@
+#define _GNU_SOURCE
+#include "bstream.h"
+#include <string.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define FAIL() exit(EXIT_FAILURE)
+#define PASS() exit(EXIT_SUCCESS)
+
+#define FILE_LEN 300000
+#define RANGE_OFFSET 1000
+
+int main() {
+    static char content[FILE_LEN];
+    static const char head[] = "Banner:\n";
+    static const char tail[] = "\nAnswer (no timeout): ";
+    static char expected[sizeof(head) + FILE_LEN + sizeof(tail)];
+    static char got[sizeof(expected)];
+
+    for ( size_t i = 0; i < sizeof(content); i++ ) content[i] = 'a' + i % 26;
+
+    FILE *fp = tmpfile();
+    if ( fp == NULL ) FAIL();
+    if ( fwrite(content, 1, sizeof(content), fp) != sizeof(content) || fflush(fp) ) FAIL();
+    int fd = fileno(fp);
+
+    size_t range_len = FILE_LEN - RANGE_OFFSET;
+    size_t expected_len = 0;
+    memcpy(expected, head, sizeof(head));
+    expected_len += sizeof(head);
+    memcpy(expected + expected_len, content + RANGE_OFFSET, range_len);
+    expected_len += range_len;
+    memcpy(expected + expected_len, tail, sizeof(tail));
+    expected_len += sizeof(tail);
+
+    struct bstream *bst = bstream_create();
+    if ( bst == NULL ) FAIL();
+
+    bstream_write_mem(bst, head, sizeof(head));
+    if ( bstream_write_file(bst, fd, RANGE_OFFSET, range_len) != range_len ) FAIL();
+    bstream_write_borrow(bst, tail, sizeof(tail));
+    if ( bstream_len(bst) != expected_len ) FAIL();
+
+    struct iovec iov[4];
+    if ( bstream_get_iov(bst, iov, 4) != 1 ) FAIL();   // Stops at the file range
+
+    int sv[2];
+    if ( socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) ) FAIL();
+
+    size_t total = 0;
+    while ( bstream_len(bst) != 0 ) {
+        size_t before = bstream_len(bst);
+        size_t sent = bstream_read_fd(bst, sv[0], before);
+        if ( bstream_len(bst) != before - sent ) FAIL();
+
+        ssize_t res;
+        while ( (res = read(sv[1], got + total, sizeof(got) - total)) > 0 ) total += res;
+        if ( sent == 0 && res != -1 ) FAIL();
+    }
+
+    if ( total != expected_len ) FAIL();
+    if ( memcmp(got, expected, expected_len) ) FAIL();
+
+    // Sinks that aren't fds read the range
+    bstream_write_file(bst, fd, 0, 100);
+    bstream_write_borrow(bst, tail, sizeof(tail));
+    if ( bstream_read_mem(bst, got, 100 + sizeof(tail)) != 100 + sizeof(tail) ) FAIL();
+    if ( memcmp(got, content, 100) || memcmp(got + 100, tail, sizeof(tail)) ) FAIL();
+    if ( bstream_len(bst) != 0 ) FAIL();
+
+    // Flushed ranges don't touch the fd
+    bstream_write_file(bst, fd, 0, 100);
+    bstream_flush(bst);
+
+    close(sv[0]);
+    close(sv[1]);
+    fclose(fp);
+    bstream_destroy(bst);
+    bstream_pool_trim(0);
+
+    PASS();
+}
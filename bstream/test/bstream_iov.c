@@ -0,0 +1,86 @@
+#define _GNU_SOURCE
+#include "bstream.h"
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define FAIL() exit(EXIT_FAILURE)
+#define PASS() exit(EXIT_SUCCESS)
+
+#define BIG_LEN 20000
+
+int main() {
+    static char big[BIG_LEN];
+    static const char tail[] = "Answer (timeout 10 seconds):\n";
+    static char expected[BIG_LEN + sizeof(tail)];
+    static char got[BIG_LEN + sizeof(tail)];
+
+    for ( size_t i = 0; i < sizeof(big); i++ ) big[i] = 'a' + i % 26;
+    memcpy(expected, big, sizeof(big));
+    memcpy(expected + sizeof(big), tail, sizeof(tail));
+
+    struct bstream *bst = bstream_create();
+    if ( bst == NULL ) FAIL();
+
+    bstream_write_borrow(bst, big, sizeof(big));
+    bstream_write_mem(bst, tail, sizeof(tail));
+
+    struct iovec iov[4];
+    if ( bstream_get_iov(bst, iov, 4) != 2 ) FAIL();   // borrowed + one copied buffer
+    if ( iov[0].iov_base != big || iov[0].iov_len != sizeof(big) ) FAIL();
+    if ( iov[1].iov_len != sizeof(tail) || memcmp(iov[1].iov_base, tail, sizeof(tail)) ) FAIL();
+    if ( bstream_get_iov(bst, iov, 1) != 1 ) FAIL();
+
+    struct bstream_span spans[4];
+    if ( bstream_peek_spans(bst, spans, 4) != 2 ) FAIL();
+    if ( spans[0].data != big || spans[0].len != sizeof(big) ) FAIL();
+    if ( spans[1].data != iov[1].iov_base || spans[1].len != sizeof(tail) ) FAIL();
+    if ( bstream_len(bst) != sizeof(big) + sizeof(tail) ) FAIL();   // Peeking consumes nothing
+
+    int pipefd[2];
+    if ( pipe2(pipefd, O_NONBLOCK) ) FAIL();
+    fcntl(pipefd[1], F_SETPIPE_SZ, 4096);   // Force partial writes
+
+    size_t total = 0;
+    while ( bstream_len(bst) != 0 ) {
+        size_t before = bstream_len(bst);
+        size_t sent = bstream_read_fd(bst, pipefd[1], before);
+        if ( sent == 0 ) FAIL();
+        if ( bstream_len(bst) != before - sent ) FAIL();   // Exactly the accepted bytes are consumed
+
+        ssize_t res;
+        while ( (res = read(pipefd[0], got + total, sizeof(got) - total)) > 0 ) total += res;
+    }
+
+    if ( total != sizeof(expected) ) FAIL();
+    if ( memcmp(got, expected, sizeof(expected)) ) FAIL();
+
+    // len smaller than the stream
+    bstream_write_mem(bst, tail, sizeof(tail));
+    if ( bstream_read_fd(bst, pipefd[1], 6) != 6 ) FAIL();
+    if ( bstream_len(bst) != sizeof(tail) - 6 ) FAIL();
+    if ( read(pipefd[0], got, sizeof(got)) != 6 || memcmp(got, tail, 6) ) FAIL();
+
+    if ( bstream_consume(bst, sizeof(tail)) != sizeof(tail) - 6 ) FAIL();
+    if ( bstream_len(bst) != 0 ) FAIL();
+
+    // Long copied payloads take one chunk per cap
+    static char long_payload[100000];
+    if ( bstream_write_mem(bst, long_payload, sizeof(long_payload)) != sizeof(long_payload) ) FAIL();
+    if ( bstream_get_iov(bst, iov, 4) != 2 ) FAIL();
+    bstream_flush(bst);
+
+    bstream_set_chunk_cap(bst, 1 << 20);
+    if ( bstream_write_mem(bst, long_payload, sizeof(long_payload)) != sizeof(long_payload) ) FAIL();
+    if ( bstream_get_iov(bst, iov, 4) != 1 ) FAIL();
+    if ( bstream_consume(bst, sizeof(long_payload)) != sizeof(long_payload) ) FAIL();
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    bstream_destroy(bst);
+    bstream_pool_trim(0);
+
+    PASS();
+}
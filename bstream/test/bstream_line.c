@@ -0,0 +1,81 @@
+#define _GNU_SOURCE
+#include "bstream.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define FAIL() exit(EXIT_FAILURE)
+#define PASS() exit(EXIT_SUCCESS)
+
+static void send_str(int fd, const char *str) {
+    if ( write(fd, str, strlen(str)) != (ssize_t)strlen(str) ) FAIL();
+}
+
+static void expect_line(struct bstream *bst, const char *line) {
+    size_t len;
+    const char *got = bstream_peek_line(bst, &len);
+    if ( got == NULL || len != strlen(line) || memcmp(got, line, len) ) FAIL();
+    if ( bstream_consume(bst, len) != len ) FAIL();
+}
+
+int main() {
+    int sv[2];
+    if ( socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) ) FAIL();
+
+    struct bstream *bst = bstream_create();
+    if ( bst == NULL ) FAIL();
+    size_t chunk_next = bst->chunk_next;
+
+    // Nothing to receive yet
+    if ( bstream_recv_fd(bst, sv[1], 64) != 0 || errno != EAGAIN ) FAIL();
+
+    // Pipelined answers, the last one isn't complete
+    send_str(sv[0], "12345\n-678\n90");
+    if ( bstream_recv_fd(bst, sv[1], 4096) != 13 ) FAIL();
+
+    size_t offset;
+    if ( !bstream_find_delim(bst, '\n', &offset) || offset != 5 ) FAIL();
+    expect_line(bst, "12345\n");
+    expect_line(bst, "-678\n");
+
+    size_t len;
+    if ( bstream_peek_line(bst, &len) != NULL ) FAIL();
+    if ( bstream_find_delim(bst, '\n', &offset) ) FAIL();
+
+    // The rest goes to the free space of the same chunk
+    send_str(sv[0], "12\n");
+    if ( bstream_recv_fd(bst, sv[1], 4096) != 3 ) FAIL();
+    expect_line(bst, "9012\n");
+    if ( bstream_len(bst) != 0 ) FAIL();
+
+    // A line split between segments is gathered into one span
+    bstream_write_borrow(bst, "first ", 6);
+    bstream_write_borrow(bst, "sec", 3);
+    send_str(sv[0], "ond\nthird\n");
+    if ( bstream_recv_fd(bst, sv[1], 4096) != 10 ) FAIL();
+    if ( !bstream_find_delim(bst, '\n', &offset) || offset != 12 ) FAIL();
+    expect_line(bst, "first second\n");
+    expect_line(bst, "third\n");
+    if ( bstream_len(bst) != 0 ) FAIL();
+
+    // A long lived receive stream doesn't grow its chunks like a send stream does
+    for ( int i = 0; i < 32; i++ ) {
+        send_str(sv[0], "42\n");
+        if ( bstream_recv_fd(bst, sv[1], 4096) != 3 ) FAIL();
+        expect_line(bst, "42\n");
+    }
+    if ( bst->chunk_next != chunk_next ) FAIL();
+
+    // EOF
+    close(sv[0]);
+    errno = EINVAL;
+    if ( bstream_recv_fd(bst, sv[1], 4096) != 0 || errno != 0 ) FAIL();
+
+    close(sv[1]);
+    bstream_destroy(bst);
+    bstream_pool_trim(0);
+
+    PASS();
+}
@@ -0,0 +1,90 @@
+#include "bstream.h"
+#include "rcmem.h"
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define FAIL() exit(EXIT_FAILURE)
+#define PASS() exit(EXIT_SUCCESS)
+
+static const char text[] = "1+2*(3-4)\nAnswer (no timeout): ";
+#define TEXT_LEN (sizeof(text) - 1)
+
+// The caller drops its reference right after the write, the returned probe one tells what the stream holds
+static char *write_text(struct bstream *bst) {
+    char *mem = rcmem_alloc(TEXT_LEN);
+    if ( mem == NULL ) FAIL();
+    memcpy(mem, text, TEXT_LEN);
+
+    char *probe = rcmem_take(mem);
+    if ( bstream_write_rcmem(bst, mem, TEXT_LEN) != TEXT_LEN ) FAIL();
+    if ( rcmem_refs(probe) != 3 ) FAIL();
+    rcmem_put(mem);
+    if ( rcmem_refs(probe) != 2 ) FAIL();
+
+    return probe;
+}
+
+static void expect_fd(int fd, const char *bytes, size_t len) {
+    char buf[TEXT_LEN];
+    if ( read(fd, buf, len) != (ssize_t)len || memcmp(buf, bytes, len) ) FAIL();
+}
+
+int main() {
+    struct bstream *bst = bstream_create();
+    if ( bst == NULL ) FAIL();
+
+    // Drained with bstream_consume, a partial drain keeps the reference
+    char *probe = write_text(bst);
+    if ( bstream_consume(bst, 4) != 4 ) FAIL();
+    if ( rcmem_refs(probe) != 2 ) FAIL();
+    if ( bstream_consume(bst, TEXT_LEN - 4) != TEXT_LEN - 4 ) FAIL();
+    if ( rcmem_refs(probe) != 1 ) FAIL();
+    if ( memcmp(probe, text, TEXT_LEN) ) FAIL();
+    rcmem_put(probe);
+
+    // Drained with bstream_read_fd
+    int fds[2];
+    if ( pipe(fds) ) FAIL();
+
+    probe = write_text(bst);
+    if ( bstream_read_fd(bst, fds[1], 10) != 10 ) FAIL();
+    expect_fd(fds[0], text, 10);
+    if ( rcmem_refs(probe) != 2 ) FAIL();
+    if ( bstream_read_fd(bst, fds[1], TEXT_LEN) != TEXT_LEN - 10 ) FAIL();
+    expect_fd(fds[0], text + 10, TEXT_LEN - 10);
+    if ( rcmem_refs(probe) != 1 ) FAIL();
+    rcmem_put(probe);
+
+    close(fds[0]);
+    close(fds[1]);
+
+    // Dropped by a flush, partially drained or not
+    char *probe2;
+    probe = write_text(bst);
+    probe2 = write_text(bst);
+    if ( bstream_consume(bst, 3) != 3 ) FAIL();
+    bstream_flush(bst);
+    if ( bstream_len(bst) != 0 ) FAIL();
+    if ( rcmem_refs(probe) != 1 || rcmem_refs(probe2) != 1 ) FAIL();
+    rcmem_put(probe);
+    rcmem_put(probe2);
+
+    // And by bstream_fini through bstream_destroy
+    probe = write_text(bst);
+    bstream_destroy(bst);
+    if ( rcmem_refs(probe) != 1 ) FAIL();
+    rcmem_put(probe);
+
+    struct bstream stack_bst;
+    bstream_init(&stack_bst);
+    probe = write_text(&stack_bst);
+    bstream_fini(&stack_bst);
+    if ( rcmem_refs(probe) != 1 ) FAIL();
+    rcmem_put(probe);
+
+    bstream_pool_trim(0);
+    rcmem_pool_trim();
+
+    PASS();
+}
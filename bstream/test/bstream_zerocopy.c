@@ -0,0 +1,95 @@
+#define _GNU_SOURCE
+#include "bstream.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define FAIL() exit(EXIT_FAILURE)
+#define PASS() exit(EXIT_SUCCESS)
+
+#define PAYLOAD_LEN 200000
+
+// Loopback TCP pair, zerocopy needs a real TCP socket
+static void tcp_pair(int *client, int *server) {
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addr_len = sizeof(addr);
+    if ( lfd == -1 || bind(lfd, (void *)&addr, sizeof(addr)) || listen(lfd, 1) ) FAIL();
+    if ( getsockname(lfd, (void *)&addr, &addr_len) ) FAIL();
+
+    *client = socket(AF_INET, SOCK_STREAM, 0);
+    if ( *client == -1 || connect(*client, (void *)&addr, sizeof(addr)) ) FAIL();
+    *server = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+    if ( *server == -1 ) FAIL();
+    close(lfd);
+}
+
+int main() {
+    static char payload[PAYLOAD_LEN];
+    static char got[PAYLOAD_LEN + 64];
+    static const char tail[] = "\nAnswer (no timeout): ";
+
+    for ( size_t i = 0; i < sizeof(payload); i++ ) payload[i] = 'a' + i % 26;
+
+    int client, server;
+    tcp_pair(&client, &server);
+
+    struct bstream *bst = bstream_create();
+    if ( bst == NULL ) FAIL();
+
+    int one = 1;
+    bool zerocopy = setsockopt(server, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    if ( zerocopy ) bstream_set_zerocopy(bst, 4096);
+
+    bstream_write_mem(bst, payload, sizeof(payload));
+    bstream_write_borrow(bst, tail, sizeof(tail));
+    size_t expected_len = sizeof(payload) + sizeof(tail);
+
+    size_t total = 0;
+    while ( total < expected_len ) {
+        size_t sent;
+        enum bstream_send_res res = bstream_send_sock(bst, server, bstream_len(bst), &sent);
+        if ( res == BSTREAM_SEND_ERROR ) FAIL();
+        if ( res == BSTREAM_SEND_DONE && bstream_len(bst) != 0 ) FAIL();
+
+        ssize_t n;
+        while ( total < expected_len && (n = recv(client, got + total, sizeof(got) - total, MSG_DONTWAIT)) > 0 )
+            total += n;
+    }
+
+    if ( total != expected_len ) FAIL();
+    if ( memcmp(got, payload, sizeof(payload)) || memcmp(got + sizeof(payload), tail, sizeof(tail)) ) FAIL();
+
+    // Drained buffers wait for their completions, then the reap frees them
+    for ( int i = 0; i < 100 && bst->zc_head != NULL; i++ ) {
+        struct pollfd pfd = {.fd = server, .events = 0};
+        poll(&pfd, 1, 10);
+        if ( bstream_reap_zerocopy(bst, server) ) FAIL();
+    }
+    if ( bst->zc_head != NULL ) FAIL();
+
+    // Nothing to send is done right away, a full socket is not an error
+    size_t sent;
+    if ( bstream_send_sock(bst, server, 0, &sent) != BSTREAM_SEND_DONE || sent != 0 ) FAIL();
+
+    static char big[4 << 20];
+    bstream_write_borrow(bst, big, sizeof(big));
+    if ( bstream_send_sock(bst, server, bstream_len(bst), &sent) != BSTREAM_SEND_AGAIN ) FAIL();
+    if ( sent == 0 || bstream_len(bst) != sizeof(big) - sent ) FAIL();
+
+    // A closed peer is an error, not backpressure
+    close(client);
+    enum bstream_send_res res;
+    while ( (res = bstream_send_sock(bst, server, bstream_len(bst), &sent)) == BSTREAM_SEND_AGAIN ) usleep(1000);
+    if ( res != BSTREAM_SEND_ERROR || (errno != EPIPE && errno != ECONNRESET) ) FAIL();
+
+    close(server);
+    bstream_destroy(bst);
+    bstream_pool_trim(0);
+
+    PASS();
+}
@@ -765,7 +765,7 @@ struct cli_match *cli_match(struct cli *cli, int argc, char **argv) {
             }
         }
 
-        if ( cli_match_add_node(match, &opt_node->id, &arg) ) {
+        if ( cli_match_add_node(match, &opt_node->id, opt_node_has_arg ? &arg : NULL) ) {
             if ( opt_node_has_arg ) cli_opt_arg_destruct(&arg);
             goto destroy_match;
         }
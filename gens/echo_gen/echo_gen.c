@@ -5,6 +5,8 @@
 #include "rcmem.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <ctype.h>
 
 static void echo_gen_question_free_text(char *text) {
     rcmem_put(text);
@@ -17,6 +19,24 @@ static enum answer_state echo_gen_check(void *priv, FILE *fp) {
     return ANSWER_RIGHT;
 }
 
+/*
+ * Any line is right, but the end of the previous answer isn't a line yet. Only the answer line is consumed,
+ * pipelined answers behind it stay for the next tasks
+ */
+static enum answer_state echo_gen_check_mem(void *priv, const char *buf, size_t len, size_t *consumed) {
+    unused(priv);
+
+    size_t i = 0;
+    while ( i < len && isspace((unsigned char)buf[i]) ) i++;
+    *consumed = i;
+
+    const char *eol = memchr(buf + i, '\n', len - i);
+    if ( eol == NULL ) return ANSWER_MORE;
+
+    *consumed = eol - buf + 1;
+    return ANSWER_RIGHT;
+}
+
 static struct question *echo_gen_get_question(void *priv) {
     char *text = priv;
 
@@ -25,6 +45,7 @@ static struct question *echo_gen_get_question(void *priv) {
 
     res->text = rcmem_take(text);
     res->free_text = echo_gen_question_free_text;
+    res->text_rc = true;
 
     return res;
 }
@@ -38,6 +59,7 @@ static struct task *echo_gen_generate(void *priv) {
     res->priv = rcmem_take(text);
     res->free_priv = rcmem_put;
     res->check = echo_gen_check;
+    res->check_mem = echo_gen_check_mem;
     res->get_question = echo_gen_get_question;
 
     return res;
@@ -2,11 +2,12 @@
 #include <errno.h>
 #include <gmp.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
 #include <string.h>
-#include "list.h"
+#include "rand.h"
 #include "utils.h"
 
 enum eq_elem_type {
@@ -26,20 +27,67 @@ enum eq_br {
     EQ_BR_R
 };
 
-struct eq_elem {
+struct eq_token {
     union {
         enum eq_op op;
-        mpz_t nr;
         enum eq_br br;
+        struct {
+            uint32_t limbs_off;   // In eq->limbs
+            uint32_t limbs_nr;    // Numbers are never negative, 0 limbs is zero
+        } nr;
     } data;
     enum eq_elem_type type;
-    struct list eq_elem_chain;
 };
 
+// The tokens live right after the header and all numbers share one limb arena, so an eq is two allocations
 struct eq {
-    struct eq_elem *eq_elems;
+    mp_limb_t *limbs;
+    size_t limbs_nr;
+    size_t text_size;   // Bound of the printed text with the zero byte, exact unless a number is over an unsigned long
+    size_t tokens_nr;
+    struct eq_token tokens[];
 };
 
+static const char eq_digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+[[gnu::const]]
+static size_t ulong_len(unsigned long x) {
+    size_t len = 1;
+    for ( ; x >= 100; x /= 100 ) len += 2;
+    return x >= 10 ? len + 1 : len;
+}
+
+// Writes exactly len = ulong_len(x) digits, two per division from the end
+static void ulong_print(unsigned long x, char *buf, size_t len) {
+    char *p = buf + len;
+    for ( ; x >= 100; x /= 100 ) {
+        p -= 2;
+        memcpy(p, &eq_digit_pairs[(x % 100) * 2], 2);
+    }
+    if ( x >= 10 ) {
+        p -= 2;
+        memcpy(p, &eq_digit_pairs[x * 2], 2);
+    } else {
+        *--p = '0' + x;
+    }
+    assert(p == buf);
+}
+
+// mpz_sizeinbase may be one more than the digits, that is what the bound is for
+static size_t nr_text_size(mpz_srcptr nr) {
+    return mpz_fits_ulong_p(nr) ? ulong_len(mpz_get_ui(nr)) : mpz_sizeinbase(nr, 10);
+}
+
 typedef unsigned eq_elem_gen_flags_t;
 
 #define EQ_GEN_OP_SUM ((eq_elem_gen_flags_t)(1 << 0))
@@ -57,7 +105,7 @@ static unsigned long bitmask_choose(unsigned long bitmask) {
         return 0ull;
     }
 
-    int index = rand() % popcount;
+    int index = rand_below(popcount);
     eq_elem_gen_flags_t mask = bitmask;
 
     for ( int i = 0; i < index; i++ ) {
@@ -70,53 +118,95 @@ static unsigned long bitmask_choose(unsigned long bitmask) {
     return chosen;
 }
 
-static struct eq_elem *eq_elem_gen(eq_elem_gen_flags_t flags, gmp_randstate_t st, const mpz_t max) {
+static struct eq_token *eq_token_gen(struct eq *eq, eq_elem_gen_flags_t flags, gmp_randstate_t st,
+                                     const mpz_t max, mpz_t nr) {
     eq_elem_gen_flags_t chosen = bitmask_choose(flags);
 
-    struct eq_elem *elem = malloc(sizeof(struct eq_elem));
-    if ( elem == NULL ) return NULL;
-    list_init(elem, eq_elem_chain);
+    struct eq_token *tok = &eq->tokens[eq->tokens_nr];
 
     switch ( chosen ) {
         case EQ_GEN_OP_SUM:
-            elem->data.op = EQ_OP_SUM;
-            elem->type = EQ_OP;
+            tok->data.op = EQ_OP_SUM;
+            tok->type = EQ_OP;
             break;
         case EQ_GEN_OP_SUB:
-            elem->data.op = EQ_OP_SUB;
-            elem->type = EQ_OP;
+            tok->data.op = EQ_OP_SUB;
+            tok->type = EQ_OP;
             break;
         case EQ_GEN_OP_MUL:
-            elem->data.op = EQ_OP_MUL;
-            elem->type = EQ_OP;
+            tok->data.op = EQ_OP_MUL;
+            tok->type = EQ_OP;
             break;
         case EQ_GEN_BR_L:
-            elem->data.br = EQ_BR_L;
-            elem->type = EQ_BR;
+            tok->data.br = EQ_BR_L;
+            tok->type = EQ_BR;
             break;
         case EQ_GEN_BR_R:
-            elem->data.br = EQ_BR_R;
-            elem->type = EQ_BR;
-            break;
-        case EQ_GEN_NR:
-            mpz_init(elem->data.nr);
-            mpz_urandomm(elem->data.nr, st, max);
-            elem->type = EQ_NR;
+            tok->data.br = EQ_BR_R;
+            tok->type = EQ_BR;
             break;
+        case EQ_GEN_NR: {
+            mpz_urandomm(nr, st, max);
+            size_t limbs_nr = mpz_size(nr);   // Below max, so the arena has room for it
+            memcpy(eq->limbs + eq->limbs_nr, mpz_limbs_read(nr), limbs_nr * sizeof(mp_limb_t));
+            tok->data.nr.limbs_off = eq->limbs_nr;
+            tok->data.nr.limbs_nr = limbs_nr;
+            tok->type = EQ_NR;
+            eq->limbs_nr += limbs_nr;
+            eq->text_size += nr_text_size(nr);
+            eq->tokens_nr++;
+            return tok;
+        }
         default:
             assert(0);
-            free(elem);
             return NULL;
     }
 
-    return elem;
+    eq->text_size++;   // Ops and brackets are one char
+    eq->tokens_nr++;
+    return tok;
 }
 
-void eq_elem_destroy(struct eq_elem *el) {
-    if ( el->type == EQ_NR ) {
-        mpz_clear(el->data.nr);
+// Read-only view of a number token, tmp needs no clearing
+static mpz_srcptr eq_token_nr(const struct eq *eq, const struct eq_token *tok, mpz_t tmp) {
+    assert(tok->type == EQ_NR);
+    return mpz_roinit_n(tmp, eq->limbs + tok->data.nr.limbs_off, tok->data.nr.limbs_nr);
+}
+
+/*
+ * Setting up a GMP randstate costs more than a short equation, so every thread keeps one. It is seeded
+ * from rand.h and cleared by the key destructor when the thread exits
+ */
+static pthread_key_t eq_randstate_key;
+static pthread_once_t eq_randstate_once = PTHREAD_ONCE_INIT;
+static __thread __gmp_randstate_struct *eq_randstate;
+
+static void eq_randstate_destroy(void *st) {
+    gmp_randclear(st);
+    free(st);
+}
+
+static void eq_randstate_key_create(void) {
+    if ( pthread_key_create(&eq_randstate_key, eq_randstate_destroy) ) abort();
+}
+
+static __gmp_randstate_struct *eq_get_randstate(void) {
+    if ( eq_randstate != NULL ) return eq_randstate;
+
+    pthread_once(&eq_randstate_once, eq_randstate_key_create);
+
+    __gmp_randstate_struct *st = malloc(sizeof(gmp_randstate_t));
+    if ( st == NULL ) return NULL;
+
+    gmp_randinit_default(st);
+    gmp_randseed_ui(st, rand_u64());
+    if ( pthread_setspecific(eq_randstate_key, st) ) {
+        eq_randstate_destroy(st);
+        return NULL;
     }
-    free(el);
+
+    eq_randstate = st;
+    return st;
 }
 
 static int rand_eq_len(int minlen, int maxlen) {
@@ -125,7 +215,7 @@ static int rand_eq_len(int minlen, int maxlen) {
 
     if ( minlen > maxlen ) return 0;
 
-    int chain_len = (rand() % (maxlen - minlen + 1)) + minlen;
+    int chain_len = rand_below(maxlen - minlen + 1) + minlen;
     // chain_len can be only odd
     if ( chain_len % 2 == 0 ) {
         if ( chain_len != maxlen ) {
@@ -163,11 +253,27 @@ struct eq *eq_generate(int minlen, int maxlen, const mpz_t max, eq_flags_t allow
     int chain_len = rand_eq_len(minlen, maxlen);
     if ( chain_len == 0 ) return NULL;
 
-    struct eq *eq = malloc(sizeof(struct eq));
+    // Every number takes at most as many limbs as max, the arena offsets have to fit into uint32_t
+    size_t tokens_size, limbs_size;
+    if ( ckd_mul(&tokens_size, (size_t)chain_len, sizeof(struct eq_token)) ) return NULL;
+    if ( ckd_add(&tokens_size, tokens_size, sizeof(struct eq)) ) return NULL;
+    if ( ckd_mul(&limbs_size, (size_t)(chain_len / 2 + 1), mpz_size(max)) ) return NULL;
+    if ( limbs_size > UINT32_MAX ) return NULL;
+
+    struct eq *eq = malloc(tokens_size);
     if ( eq == NULL ) return NULL;
+    eq->tokens_nr = 0;
+    eq->limbs_nr = 0;
+    eq->text_size = 1;   // Zero byte
+    eq->limbs = malloc(max(limbs_size, 1u) * sizeof(mp_limb_t));
+    if ( eq->limbs == NULL ) {
+        free(eq);
+        return NULL;
+    }
+
+    mpz_t nr;
+    mpz_init(nr);   // Numbers are drawn here and copied to the arena
 
-    struct eq_elem *chain = NULL;
-    struct eq_elem *tail = NULL;
     eq_elem_gen_flags_t flags = 0;
 
     int br_l_avail = chain_len / 2;
@@ -179,9 +285,8 @@ struct eq *eq_generate(int minlen, int maxlen, const mpz_t max, eq_flags_t allow
     bool op_possible = false;
     bool nr_possible = true;
 
-    gmp_randstate_t st;
-    gmp_randinit_default(st);
-    gmp_randseed_ui(st, time(NULL));
+    __gmp_randstate_struct *st = eq_get_randstate();
+    if ( st == NULL ) goto fallback;
 
     for ( int i = 0; i < chain_len; i++ ) {
         if ( br_l_possible ) flags |= EQ_GEN_BR_L;
@@ -192,7 +297,7 @@ struct eq *eq_generate(int minlen, int maxlen, const mpz_t max, eq_flags_t allow
         // nr is always allowed
         if ( nr_possible ) flags |= EQ_GEN_NR;
 
-        struct eq_elem *new = eq_elem_gen(flags, st, max);
+        const struct eq_token *new = eq_token_gen(eq, flags, st, max, nr);
         if ( new == NULL ) goto fallback;
 
         if ( new->type == EQ_OP ) {
@@ -231,30 +336,14 @@ struct eq *eq_generate(int minlen, int maxlen, const mpz_t max, eq_flags_t allow
             assert(0);
         }
         flags = 0;
-
-        if ( tail == NULL ) {
-            chain = new;
-            tail = new;
-        } else {
-            list_add_tail(tail, new, eq_elem_chain);
-            tail = new;
-        }
     }
 
-    gmp_randclear(st);
-
-    eq->eq_elems = chain;
-
+    mpz_clear(nr);
     return eq;
 
 fallback:
-    gmp_randclear(st);
-    if ( chain ) {
-        list_foreach_safe(chain, eq_elem_chain, iter) {
-            eq_elem_destroy(iter);
-        }
-    }
-    free(eq);
+    mpz_clear(nr);
+    eq_destroy(eq);
     return NULL;
 }
 
@@ -273,82 +362,164 @@ fallback:
  *  ( EXPRESSION )
  */
 
-static int eq_get_primary(struct eq_elem **chain, mpz_t out);
-static int eq_get_term(struct eq_elem **chain, mpz_t out);
-static int eq_get_expression(struct eq_elem **chain, mpz_t out);
+struct eq_cursor {
+    const struct eq *eq;
+    size_t pos;
+};
+
+// NULL past the last token
+static const struct eq_token *eq_cursor_peek(const struct eq_cursor *cur) {
+    return cur->pos < cur->eq->tokens_nr ? &cur->eq->tokens[cur->pos] : NULL;
+}
 
-static int eq_get_primary(struct eq_elem **chain, mpz_t out) {
-    assert(chain);
-    struct eq_elem *elem = *chain;
+/*
+ * Values stay in __int128 while they fit, most sub-expressions of the usual tasks do. The first overflow moves
+ * a value to its mpz_t for good, the mpz_t is kept once initialized so reused values don't allocate again
+ */
+struct eq_val {
+    __int128 small;
+    bool is_big;
+    bool big_init;
+    mpz_t big;
+};
+
+#define EQ_VAL_INIT ((struct eq_val){ .small = 0, .is_big = false, .big_init = false })
+
+static void eq_val_clear(struct eq_val *v) {
+    if ( v->big_init ) mpz_clear(v->big);
+}
+
+static void mpz_set_i128(mpz_t out, __int128 x) {
+    unsigned __int128 u = x < 0 ? -(unsigned __int128)x : (unsigned __int128)x;
+    uint64_t words[2] = { (uint64_t)u, (uint64_t)(u >> 64) };   // Least significant first
+
+    mpz_import(out, countof(words), -1, sizeof(words[0]), 0, 0, words);
+    if ( x < 0 ) mpz_neg(out, out);
+}
 
-    if ( elem == NULL ) {
+static void eq_val_promote(struct eq_val *v) {
+    if ( v->is_big ) return;
+
+    if ( !v->big_init ) {
+        mpz_init(v->big);
+        v->big_init = true;
+    }
+    mpz_set_i128(v->big, v->small);
+    v->is_big = true;
+}
+
+static void eq_val_set_nr(struct eq_val *v, mpz_srcptr nr) {
+    if ( mpz_fits_ulong_p(nr) ) {
+        v->small = mpz_get_ui(nr);
+        v->is_big = false;
+    } else {
+        if ( !v->big_init ) {
+            mpz_init(v->big);
+            v->big_init = true;
+        }
+        mpz_set(v->big, nr);
+        v->is_big = true;
+    }
+}
+
+static void eq_val_get(const struct eq_val *v, mpz_t out) {
+    if ( v->is_big ) {
+        mpz_set(out, v->big);
+    } else {
+        mpz_set_i128(out, v->small);
+    }
+}
+
+// left op= right, right may be promoted
+static void eq_val_apply(struct eq_val *left, struct eq_val *right, enum eq_op op) {
+    if ( !left->is_big && !right->is_big ) {
+        __int128 res;
+        bool overflow;
+        switch ( op ) {
+            case EQ_OP_SUM: overflow = ckd_add(&res, left->small, right->small); break;
+            case EQ_OP_SUB: overflow = ckd_sub(&res, left->small, right->small); break;
+            case EQ_OP_MUL: overflow = ckd_mul(&res, left->small, right->small); break;
+            default: assert(0); return;
+        }
+        if ( !overflow ) {
+            left->small = res;
+            return;
+        }
+    }
+
+    eq_val_promote(left);
+    eq_val_promote(right);
+    switch ( op ) {
+        case EQ_OP_SUM: mpz_add(left->big, left->big, right->big); break;
+        case EQ_OP_SUB: mpz_sub(left->big, left->big, right->big); break;
+        case EQ_OP_MUL: mpz_mul(left->big, left->big, right->big); break;
+        default: assert(0); break;
+    }
+}
+
+static int eq_get_primary(struct eq_cursor *cur, struct eq_val *out);
+static int eq_get_term(struct eq_cursor *cur, struct eq_val *out);
+static int eq_get_expression(struct eq_cursor *cur, struct eq_val *out);
+
+static int eq_get_primary(struct eq_cursor *cur, struct eq_val *out) {
+    assert(cur);
+    const struct eq_token *tok = eq_cursor_peek(cur);
+
+    if ( tok == NULL ) {
         errno = EILSEQ;
         return false;
     }
 
-    if ( elem->type == EQ_NR ) {
-        *chain = list_get_next(elem, eq_elem_chain);
-        mpz_set(out, elem->data.nr);
+    if ( tok->type == EQ_NR ) {
+        cur->pos++;
+        mpz_t tmp;
+        eq_val_set_nr(out, eq_token_nr(cur->eq, tok, tmp));
         return true;
-    } else if ( elem->type == EQ_BR ) {
-        if ( elem->data.br != EQ_BR_L ) {
+    } else if ( tok->type == EQ_BR ) {
+        if ( tok->data.br != EQ_BR_L ) {
             errno = EILSEQ;
             return false;
         }
 
-        *chain = list_get_next(elem, eq_elem_chain);
-        mpz_t res;
-        mpz_init(res);
-        if ( eq_get_expression(chain, res) ) {
-            elem = *chain;
-            if ( elem == NULL ) {
-                errno = EILSEQ;
-                mpz_clear(res);
-                return false;
-            }
-            if ( elem->type != EQ_BR || elem->data.br != EQ_BR_R ) {
-                errno = EILSEQ;
-                mpz_clear(res);
-                return false;
-            }
-            *chain = list_get_next(elem, eq_elem_chain);
-            mpz_set(out, res);
-            mpz_clear(res);
-            return true;
-        } else {
-            mpz_clear(res);
+        cur->pos++;
+        if ( !eq_get_expression(cur, out) ) return false;
+
+        tok = eq_cursor_peek(cur);
+        if ( tok == NULL || tok->type != EQ_BR || tok->data.br != EQ_BR_R ) {
+            errno = EILSEQ;
             return false;
         }
+        cur->pos++;
+        return true;
     } else {
         errno = EILSEQ;
         return false;
     }
 }
 
-static int eq_get_term(struct eq_elem **chain, mpz_t out) {
-    assert(chain);
+static int eq_get_term(struct eq_cursor *cur, struct eq_val *out) {
+    assert(cur);
 
-    mpz_t left, right;
-    mpz_inits(left, right, NULL);
+    struct eq_val right = EQ_VAL_INIT;
 
-    if ( !eq_get_primary(chain, left) ) goto fallback;
+    if ( !eq_get_primary(cur, out) ) goto fallback;
 
-    struct eq_elem *elem = *chain;
+    const struct eq_token *tok = eq_cursor_peek(cur);
 
     while ( true ) {
-        if ( elem == NULL ) goto good_exit;
-
-        if ( elem->type == EQ_OP ) {
-            if ( elem->data.op == EQ_OP_MUL ) {
-                *chain = list_get_next(elem, eq_elem_chain);
-                if ( !eq_get_primary(chain, right) ) goto fallback;
-                mpz_mul(left, left, right);
-                elem = *chain;
+        if ( tok == NULL ) goto good_exit;
+
+        if ( tok->type == EQ_OP ) {
+            if ( tok->data.op == EQ_OP_MUL ) {
+                cur->pos++;
+                if ( !eq_get_primary(cur, &right) ) goto fallback;
+                eq_val_apply(out, &right, EQ_OP_MUL);
+                tok = eq_cursor_peek(cur);
             } else {
                 goto good_exit;
             }
-        } else if ( elem->type == EQ_BR ) {
-            assert(elem->data.br == EQ_BR_R);
+        } else if ( tok->type == EQ_BR ) {
+            assert(tok->data.br == EQ_BR_R);
             goto good_exit;
         } else {
             errno = EILSEQ;
@@ -357,43 +528,36 @@ static int eq_get_term(struct eq_elem **chain, mpz_t out) {
     }
 
 good_exit:
-    mpz_set(out, left);
-    mpz_clears(left, right, NULL);
+    eq_val_clear(&right);
     return true;
 fallback:
-    mpz_clears(left, right, NULL);
+    eq_val_clear(&right);
     return false;
 }
 
-static int eq_get_expression(struct eq_elem **chain, mpz_t out) {
-    assert(chain);
+static int eq_get_expression(struct eq_cursor *cur, struct eq_val *out) {
+    assert(cur);
 
-    mpz_t left, right;
-    mpz_inits(left, right, NULL);
+    struct eq_val right = EQ_VAL_INIT;
 
-    if ( !eq_get_term(chain, left) ) goto fallback;
+    if ( !eq_get_term(cur, out) ) goto fallback;
 
-    struct eq_elem *elem = *chain;
+    const struct eq_token *tok = eq_cursor_peek(cur);
 
     while ( true ) {
-        if ( elem == NULL ) goto good_exit;
-
-        if ( elem->type == EQ_OP ) {
-            if ( elem->data.op == EQ_OP_SUM ) {
-                *chain = list_get_next(elem, eq_elem_chain);
-                if ( !eq_get_term(chain, right) ) goto fallback;
-                mpz_add(left, left, right);
-                elem = *chain;
-            } else if ( elem->data.op == EQ_OP_SUB ) {
-                *chain = list_get_next(elem, eq_elem_chain);
-                if ( !eq_get_term(chain, right) ) goto fallback;
-                mpz_sub(left, left, right);
-                elem = *chain;
+        if ( tok == NULL ) goto good_exit;
+
+        if ( tok->type == EQ_OP ) {
+            if ( tok->data.op == EQ_OP_SUM || tok->data.op == EQ_OP_SUB ) {
+                cur->pos++;
+                if ( !eq_get_term(cur, &right) ) goto fallback;
+                eq_val_apply(out, &right, tok->data.op);
+                tok = eq_cursor_peek(cur);
             } else {
                 goto good_exit;
             }
-        } else if ( elem->type == EQ_BR ) {
-            assert(elem->data.br == EQ_BR_R);
+        } else if ( tok->type == EQ_BR ) {
+            assert(tok->data.br == EQ_BR_R);
             goto good_exit;
         } else {
             errno = EILSEQ;
@@ -402,80 +566,41 @@ static int eq_get_expression(struct eq_elem **chain, mpz_t out) {
     }
 
 good_exit:
-    mpz_set(out, left);
-    mpz_clears(left, right, NULL);
+    eq_val_clear(&right);
     return true;
 
 fallback:
-    mpz_clears(left, right, NULL);
+    eq_val_clear(&right);
     return false;
 }
 
-static size_t int_len(const mpz_t val) {
-    if ( mpz_cmp_ui(val, 0u) == 0 ) return 1;
-
-    size_t len = 0;
-
-    mpz_t t;
-
-    if ( mpz_sgn(val) == -1 ) {
-        len = 1;
-        mpz_init(t);
-        mpz_abs(t, val);
-    } else {
-        mpz_init_set(t, val);
-    }
-
-    while ( mpz_cmp_ui(t, 0u) != 0 ) {
-        mpz_fdiv_q_ui(t, t, 10u);
-        if ( ckd_add(&len, len, 1) ) {
-            mpz_clear(t);
-            return 0;
-        }
-    }
-
-    mpz_clear(t);
-    return len;
-}
-
-static size_t eq_calc_str_size(const struct eq *eq) {
-    size_t res = 1;   // 1 for zero byte
-
-    struct eq_elem *chain = eq->eq_elems;
-
-    list_foreach(chain, eq_elem_chain, iter) {
-        if ( iter->type == EQ_BR ) {
-            if ( ckd_add(&res, res, 1) ) goto fail;
-        } else if ( iter->type == EQ_OP ) {
-            if ( ckd_add(&res, res, 1) ) goto fail;
-        } else if ( iter->type == EQ_NR ) {
-            size_t intlen = int_len(iter->data.nr);
-                
-            if ( intlen == 0 ) goto fail;
-            if ( ckd_add(&res, res, intlen) ) goto fail;
-        }
-    }
-
-    return res;
-fail:
-    return 0;
-}
-
-static size_t eq_elem_print(const struct eq_elem *elem, char *buf) {
-    if ( elem->type == EQ_BR ) {
-        if ( elem->data.br == EQ_BR_L ) {
+static size_t eq_token_print(const struct eq *eq, const struct eq_token *tok, char *buf) {
+    if ( tok->type == EQ_BR ) {
+        if ( tok->data.br == EQ_BR_L ) {
             buf[0] = '(';
-        } else if ( elem->data.br == EQ_BR_R ) {
+        } else if ( tok->data.br == EQ_BR_R ) {
             buf[0] = ')';
         } else {
             assert(0);
             return 0;
         }
         return 1;
-    } else if ( elem->type == EQ_NR ) {
-        return gmp_sprintf(buf, "%Zd", elem->data.nr);
-    } else if ( elem->type == EQ_OP ) {
-        switch ( elem->data.op ) {
+    } else if ( tok->type == EQ_NR ) {
+        mpz_t tmp;
+        mpz_srcptr nr = eq_token_nr(eq, tok, tmp);
+        if ( mpz_fits_ulong_p(nr) ) {
+            unsigned long x = mpz_get_ui(nr);
+            size_t len = ulong_len(x);
+            ulong_print(x, buf, len);
+            return len;
+        }
+
+        // Writes the digits and a zero byte, the bound leaves room for both
+        size_t len = mpz_sizeinbase(nr, 10);
+        mpz_get_str(buf, 10, nr);
+        return buf[len - 1] == '\0' ? len - 1 : len;
+    } else if ( tok->type == EQ_OP ) {
+        switch ( tok->data.op ) {
             case EQ_OP_SUM: buf[0] = '+'; return 1;
             case EQ_OP_SUB: buf[0] = '-'; return 1;
             case EQ_OP_MUL: buf[0] = '*'; return 1;
@@ -487,39 +612,42 @@ static size_t eq_elem_print(const struct eq_elem *elem, char *buf) {
     }
 }
 
-int eq_print(const struct eq *eq, char *buffer) {
+size_t eq_print(const struct eq *eq, char *buffer) {
     assert(eq);
-    assert(eq->eq_elems);
+    assert(eq->tokens_nr);
     size_t index = 0;
-    struct eq_elem *chain = eq->eq_elems;
-    list_foreach(chain, eq_elem_chain, iter) {
+    for ( size_t i = 0; i < eq->tokens_nr; i++ ) {
         size_t incr;
-        incr = eq_elem_print(iter, shiftptr(buffer, index));
-        if ( incr == 0 ) return false;
+        incr = eq_token_print(eq, &eq->tokens[i], shiftptr(buffer, index));
+        if ( incr == 0 ) return 0;
         index += incr;
     }
+    assert(index < eq->text_size);
+    buffer[index] = '\0';
 
-    return true;
+    return index;
 }
 
 size_t eq_print_buffer_size(const struct eq *eq) {
-    return eq_calc_str_size(eq);
+    return eq->text_size;
 }
 
 int eq_solve(const struct eq *eq, mpz_t out) {
     assert(eq);
-    assert(eq->eq_elems);
-    struct eq_elem *chain = eq->eq_elems;
-    return eq_get_expression(&chain, out);
+    assert(eq->tokens_nr);
+    struct eq_cursor cur = { .eq = eq, .pos = 0 };
+    struct eq_val res = EQ_VAL_INIT;
+
+    int ok = eq_get_expression(&cur, &res);
+    if ( ok ) eq_val_get(&res, out);
+
+    eq_val_clear(&res);
+    return ok;
 }
 
 void eq_destroy(struct eq * eq) {
     if ( eq == NULL ) return;
 
-    assert(eq->eq_elems);
-
-    list_foreach_safe(eq->eq_elems, eq_elem_chain, iter) {
-        eq_elem_destroy(iter);
-    }
+    free(eq->limbs);
     free(eq);
 }
@@ -8,7 +8,9 @@
 struct eq;
 
 struct eq *eq_generate(int minlen, int maxlen, const mpz_t max, eq_flags_t allowed_ops);
-int eq_print(const struct eq *eq, char *buffer);
+// buffer holds eq_print_buffer_size bytes, returns the text length without the zero byte or 0 on failure
+size_t eq_print(const struct eq *eq, char *buffer);
+// Known since the generation, may be a few bytes more than the text takes
 size_t eq_print_buffer_size(const struct eq *eq);
 int eq_solve(const struct eq* eq, mpz_t out);
 void eq_destroy(struct eq* eq);
@@ -1,4 +1,7 @@
+#define _GNU_SOURCE
 #include "eq_gen.h"
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include "eq.h"
 #include "gen_types.h"
@@ -7,12 +10,36 @@
 #include "rcmem.h"
 #include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
 
 struct eq_gen_priv {
     int minlen;
     int maxlen;
     mpz_t maxnr;
     eq_flags_t allowed;
+    struct eq_pool *pool;   // Tasks come from it first if set, the parameters above aren't used then
+};
+
+struct eq_task_priv;
+
+struct eq_pool {
+    int minlen;
+    int maxlen;
+    mpz_t maxnr;
+    eq_flags_t allowed;
+
+    pthread_t thread;
+    pthread_mutex_t mtx;
+    pthread_cond_t refill;   // The queue dropped below low_water or the pool stops
+    bool stopping;
+
+    struct eq_task_priv **ready;   // Ring of prepared tasks
+    unsigned head;
+    unsigned nr;
+    unsigned capacity;
+    unsigned low_water;
+
+    struct eq_pool_stats stats;   // Under mtx, ready, capacity and low_water are filled on read
 };
 
 struct eq_task_priv {
@@ -28,30 +55,44 @@ static void eq_free_text(char *text) {
     rcmem_put(text);
 }
 
+// Texts made by the pool filler are referenced from worker threads, their counters have to be atomic
+static bool eq_cache_text(struct eq_task_priv *priv, bool shared) {
+    if ( priv->text_cached ) return true;
+
+    assert(priv->text_rc == NULL);
+    size_t size = eq_print_buffer_size(priv->eq);
+    if ( size == 0 ) return false;
+    char * __rc text = shared ? rcmem_alloc_shared(size) : rcmem_alloc(size);
+    if ( text == NULL ) return false;
+    if ( eq_print(priv->eq, text) == 0 ) {
+        rcmem_put(text);
+        return false;
+    }
+
+    priv->text_rc = rcmem_move(text);
+    priv->text_cached = true;
+    return true;
+}
+
+static bool eq_cache_answer(struct eq_task_priv *priv) {
+    if ( priv->answer_cached ) return true;
+
+    if ( !eq_solve(priv->eq, priv->answer) ) return false;
+    priv->answer_cached = true;
+    return true;
+}
+
 static struct question *eq_get_question(void *p) { 
     struct eq_task_priv *priv = p;
 
-    if ( !priv->text_cached ) {
-        assert(priv->text_rc == NULL);
-        size_t size = eq_print_buffer_size(priv->eq);
-        if ( size == 0 ) return NULL;
-        char * __rc text = rcmem_alloc(size);
-        text[size - 1] = '\0';
-        if ( text == NULL ) return NULL;
-        if ( !eq_print(priv->eq, text) ) {
-            rcmem_put(text);
-            return NULL;
-        }
-
-        priv->text_rc = rcmem_move(text);
-        priv->text_cached = true;
-    }
+    if ( !eq_cache_text(priv, false) ) return NULL;
 
     struct question *q = malloc(sizeof(struct question));
     if ( q == NULL ) return NULL; //At least we cached the text
 
     q->text = rcmem_take(priv->text_rc);
     q->free_text = eq_free_text;
+    q->text_rc = true;
     return q;
 }
 
@@ -68,10 +109,7 @@ static enum answer_state eq_check(void *p, FILE *fp) {
     assert(fp);
     struct eq_task_priv *priv = p;
 
-    if ( !priv->answer_cached ) {
-        if ( !eq_solve(priv->eq, priv->answer) ) return ANSWER_WRONG;
-        priv->answer_cached = true;
-    }
+    if ( !eq_cache_answer(priv) ) return ANSWER_WRONG;
 
     mpz_t answer;
     mpz_init(answer);
@@ -90,43 +128,246 @@ static enum answer_state eq_check(void *p, FILE *fp) {
         return ANSWER_WRONG;
     }
 }
-static struct task *eq_gen_generate(void *priv) {
-    struct eq_gen_priv *priv_ = priv;
+#define EQ_ANSWER_STACK_LEN 128
 
-    struct task *task = malloc(sizeof(struct task));
-    if ( task == NULL ) return NULL;
+static enum answer_state eq_check_mem(void *p, const char *buf, size_t len, size_t *consumed) {
+    assert(p);
+    assert(buf);
+    struct eq_task_priv *priv = p;
+
+    if ( !eq_cache_answer(priv) ) return ANSWER_WRONG;
 
+    // Like mpz_inp_str: leading whitespace, optional minus and digits up to the first other byte
+    size_t i = 0;
+    while ( i < len && isspace((unsigned char)buf[i]) ) i++;
+    *consumed = i;
+
+    size_t start = i;
+    if ( i < len && buf[i] == '-' ) i++;
+    size_t digits = i;
+    while ( i < len && isdigit((unsigned char)buf[i]) ) i++;
+
+    if ( i == len ) return ANSWER_MORE;   // The number can go on in the next bytes
+    if ( i == digits ) return ANSWER_WRONG;
+
+    *consumed = i;
+
+    size_t nlen = i - start;
+    char stack_str[EQ_ANSWER_STACK_LEN];
+    char *str = nlen < sizeof(stack_str) ? stack_str : malloc(nlen + 1);
+    if ( str == NULL ) return ANSWER_WRONG;
+    memcpy(str, buf + start, nlen);
+    str[nlen] = '\0';
+
+    mpz_t answer;
+    mpz_init(answer);
+    int r = mpz_set_str(answer, str, 10);
+    if ( str != stack_str ) free(str);
+    if ( r == -1 ) {
+        mpz_clear(answer);
+        return ANSWER_WRONG;
+    }
+
+    int cmp = mpz_cmp(answer, priv->answer);
+    mpz_clear(answer);
+
+    return cmp == 0 ? ANSWER_RIGHT : ANSWER_WRONG;
+}
+
+static struct eq_task_priv *eq_task_priv_create(int minlen, int maxlen, const mpz_t maxnr, eq_flags_t allowed) {
     struct eq_task_priv *tpriv = malloc(sizeof(struct eq_task_priv));
-    if ( tpriv == NULL ) goto free_task;
+    if ( tpriv == NULL ) return NULL;
+
+    tpriv->eq = eq_generate(minlen, maxlen, maxnr, allowed);
+    if ( tpriv->eq == NULL ) {
+        free(tpriv);
+        return NULL;
+    }
 
-    tpriv->eq = eq_generate(priv_->minlen, priv_->maxlen, priv_->maxnr, priv_->allowed);
-    if ( tpriv->eq == NULL ) goto free_tpriv;
     mpz_init(tpriv->answer);
     tpriv->answer_cached = false;
     tpriv->text_rc = NULL;
     tpriv->text_cached = false;
 
+    return tpriv;
+}
+
+static struct task *eq_task_create(struct eq_task_priv *tpriv) {
+    struct task *task = malloc(sizeof(struct task));
+    if ( task == NULL ) return NULL;
+
     task->priv = tpriv;
     task->get_question = eq_get_question;
     task->free_priv = eq_free;
     task->check = eq_check;
+    task->check_mem = eq_check_mem;
 
     return task;
+}
 
-free_tpriv:
-    free(tpriv);
-free_task:
-    free(task);
-    return NULL;
+// Takes a prepared task, NULL if the queue is empty
+static struct eq_task_priv *eq_pool_pop(struct eq_pool *pool) {
+    struct eq_task_priv *tpriv = NULL;
+
+    pthread_mutex_lock(&pool->mtx);
+    if ( pool->nr != 0 ) {
+        tpriv = pool->ready[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->nr--;
+        pool->stats.hits++;
+    } else {
+        pool->stats.misses++;
+    }
+
+    if ( pool->nr < pool->low_water ) pthread_cond_signal(&pool->refill);
+    pthread_mutex_unlock(&pool->mtx);
+
+    return tpriv;
+}
+
+static struct task *eq_gen_generate(void *priv) {
+    struct eq_gen_priv *priv_ = priv;
+
+    struct eq_task_priv *tpriv = NULL;
+    if ( priv_->pool != NULL ) {
+        struct eq_pool *pool = priv_->pool;
+        tpriv = eq_pool_pop(pool);
+        if ( tpriv == NULL ) tpriv = eq_task_priv_create(pool->minlen, pool->maxlen, pool->maxnr, pool->allowed);
+    } else {
+        tpriv = eq_task_priv_create(priv_->minlen, priv_->maxlen, priv_->maxnr, priv_->allowed);
+    }
+    if ( tpriv == NULL ) return NULL;
+
+    struct task *task = eq_task_create(tpriv);
+    if ( task == NULL ) eq_free(tpriv);
+
+    return task;
 }
 
 static void eq_gen_free_priv(void *priv) {
     struct eq_gen_priv *p = priv;
-    mpz_clear(p->maxnr);
+    if ( p->pool == NULL ) mpz_clear(p->maxnr);
     free(priv);
     return;
 }
 
+static void *eq_pool_thread(void *arg) {
+    struct eq_pool *pool = arg;
+
+    // Only spare CPU time, workers serving clients always come first
+    struct sched_param sp = {0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+
+    pthread_mutex_lock(&pool->mtx);
+    bool failed = false;
+    while ( true ) {
+        // After a failure wait for the next signal, otherwise we'd spin while there is no memory
+        while ( !pool->stopping && (failed || pool->nr >= pool->low_water) ) {
+            pthread_cond_wait(&pool->refill, &pool->mtx);
+            failed = false;
+        }
+        if ( pool->stopping ) break;
+
+        pool->stats.refills++;
+        while ( !pool->stopping && pool->nr < pool->capacity ) {
+            pthread_mutex_unlock(&pool->mtx);
+
+            // Everything a worker would do on the first question and answer is done here
+            struct eq_task_priv *tpriv = eq_task_priv_create(pool->minlen, pool->maxlen, pool->maxnr, pool->allowed);
+            if ( tpriv != NULL && (!eq_cache_text(tpriv, true) || !eq_cache_answer(tpriv)) ) {
+                eq_free(tpriv);
+                tpriv = NULL;
+            }
+
+            pthread_mutex_lock(&pool->mtx);
+            if ( tpriv == NULL ) {
+                failed = true;
+                break;
+            }
+
+            pool->ready[(pool->head + pool->nr) % pool->capacity] = tpriv;
+            pool->nr++;
+            pool->stats.generated++;
+        }
+    }
+    pthread_mutex_unlock(&pool->mtx);
+
+    rcmem_pool_flush();   // The texts are freed by the workers, but our magazines would be lost
+    return NULL;
+}
+
+struct eq_pool *eq_pool_create(
+    int minlen, int maxlen, unsigned maxnr, eq_flags_t allowed, unsigned capacity, unsigned low_water
+) {
+    if ( capacity == 0 ) return NULL;
+
+    struct eq_pool *pool = malloc(sizeof(struct eq_pool));
+    if ( pool == NULL ) return NULL;
+
+    pool->ready = malloc(sizeof(*pool->ready) * capacity);
+    if ( pool->ready == NULL ) goto free_pool;
+
+    pool->minlen = minlen;
+    pool->maxlen = maxlen;
+    mpz_init_set_ui(pool->maxnr, maxnr);
+    pool->allowed = allowed;
+
+    pool->stopping = false;
+    pool->head = 0;
+    pool->nr = 0;
+    pool->capacity = capacity;
+    pool->low_water = min(max(low_water, 1u), capacity);
+    pool->stats = (struct eq_pool_stats){0};
+
+    if ( pthread_mutex_init(&pool->mtx, NULL) ) goto clear_maxnr;
+    if ( pthread_cond_init(&pool->refill, NULL) ) goto destroy_mtx;
+    if ( pthread_create(&pool->thread, NULL, eq_pool_thread, pool) ) goto destroy_cond;
+
+    return pool;
+
+destroy_cond:
+    pthread_cond_destroy(&pool->refill);
+destroy_mtx:
+    pthread_mutex_destroy(&pool->mtx);
+clear_maxnr:
+    mpz_clear(pool->maxnr);
+    free(pool->ready);
+free_pool:
+    free(pool);
+    return NULL;
+}
+
+void eq_pool_destroy(struct eq_pool *pool) {
+    assert(pool);
+
+    pthread_mutex_lock(&pool->mtx);
+    pool->stopping = true;
+    pthread_cond_signal(&pool->refill);
+    pthread_mutex_unlock(&pool->mtx);
+    pthread_join(pool->thread, NULL);
+
+    for ( unsigned i = 0; i < pool->nr; i++ ) eq_free(pool->ready[(pool->head + i) % pool->capacity]);
+
+    pthread_cond_destroy(&pool->refill);
+    pthread_mutex_destroy(&pool->mtx);
+    mpz_clear(pool->maxnr);
+    free(pool->ready);
+    free(pool);
+}
+
+void eq_pool_get_stats(struct eq_pool *pool, struct eq_pool_stats *out) {
+    assert(pool);
+    assert(out);
+
+    pthread_mutex_lock(&pool->mtx);
+    *out = pool->stats;
+    out->ready = pool->nr;
+    pthread_mutex_unlock(&pool->mtx);
+
+    out->capacity = pool->capacity;
+    out->low_water = pool->low_water;
+}
+
 struct gen *eq_gen_create(int minlen, int maxlen, unsigned maxnr, eq_flags_t allowed) {
     struct gen *eq_gen = malloc(sizeof(struct gen));
     if ( eq_gen == NULL ) return NULL;
@@ -138,6 +379,7 @@ struct gen *eq_gen_create(int minlen, int maxlen, unsigned maxnr, eq_flags_t all
     priv->maxlen = maxlen;
     mpz_init_set_ui(priv->maxnr, maxnr);
     priv->allowed = allowed;
+    priv->pool = NULL;
 
     eq_gen->priv = priv;
     eq_gen->generate = eq_gen_generate;
@@ -149,3 +391,24 @@ free_eq_gen:
     free(eq_gen);
     return NULL;
 }
+
+struct gen *eq_gen_create_pooled(struct eq_pool *pool) {
+    assert(pool);
+
+    struct gen *eq_gen = malloc(sizeof(struct gen));
+    if ( eq_gen == NULL ) return NULL;
+
+    struct eq_gen_priv *priv = malloc(sizeof(struct eq_gen_priv));
+    if ( priv == NULL ) {
+        free(eq_gen);
+        return NULL;
+    }
+
+    priv->pool = pool;
+
+    eq_gen->priv = priv;
+    eq_gen->generate = eq_gen_generate;
+    eq_gen->free_priv = eq_gen_free_priv;
+
+    return eq_gen;
+}
@@ -5,3 +5,32 @@
 
 [[gnu::malloc]]
 extern struct gen *eq_gen_create(int minlen, int maxlen, unsigned maxnr, eq_flags_t allowed);
+
+/*
+ * Ready-queue of eqs shared by many gens. A SCHED_IDLE thread keeps up to capacity eqs with their text and answer
+ * already computed and starts refilling when fewer than low_water are left. Gens take from it under a mutex
+ * and generate on the spot when it's empty
+ */
+struct eq_pool;
+
+struct eq_pool_stats {
+    unsigned long hits;        // Tasks taken ready
+    unsigned long misses;      // Tasks generated on the spot because the queue was empty
+    unsigned long generated;   // By the pool thread
+    unsigned long refills;     // Times the thread woke up to refill
+    unsigned ready;
+    unsigned capacity;
+    unsigned low_water;
+};
+
+[[gnu::malloc]]
+extern struct eq_pool *eq_pool_create(
+    int minlen, int maxlen, unsigned maxnr, eq_flags_t allowed, unsigned capacity, unsigned low_water
+);
+// Gens created from the pool have to be destroyed already
+extern void eq_pool_destroy(struct eq_pool *pool);
+extern void eq_pool_get_stats(struct eq_pool *pool, struct eq_pool_stats *out);
+
+// Like eq_gen_create with the pool parameters, but takes prepared tasks from it
+[[gnu::malloc]]
+extern struct gen *eq_gen_create_pooled(struct eq_pool *pool);
@@ -29,6 +29,28 @@ enum answer_state task_check(const struct task *task, FILE *answer_stream) {
     return task->check(task->priv, answer_stream);
 }
 
+enum answer_state task_check_mem(const struct task *task, const char *buf, size_t len, size_t *consumed) {
+    assert(task);
+    assert(buf);
+    assert(consumed);
+
+    *consumed = 0;
+    if ( len == 0 ) return ANSWER_MORE;
+
+    if ( task->check_mem != NULL ) return task->check_mem(task->priv, buf, len, consumed);
+
+    // The gen only knows streams
+    FILE *fp = fmemopen((void *)buf, len, "r");
+    if ( fp == NULL ) return ANSWER_WRONG;
+
+    enum answer_state res = task_check(task, fp);
+    long pos = ftell(fp);
+    *consumed = pos < 0 ? len : (size_t)pos;
+    fclose(fp);
+
+    return res;
+}
+
 void task_destroy(struct task *task) {
     assert(task);
     assert(task->free_priv);
@@ -41,6 +63,11 @@ const char *question_get_text(const struct question *q) {
     return q->text;
 }
 
+bool question_text_is_rc(const struct question *q) {
+    assert(q);
+    return q->text_rc;
+}
+
 void question_destroy(struct question *q) {
     assert(q);
     assert(q->free_text);
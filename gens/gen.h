@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <time.h>
 
@@ -23,7 +25,14 @@ extern void gen_destroy(struct gen *gen);
 [[gnu::malloc]]
 extern struct question *task_get_question(struct task *task);
 extern enum answer_state task_check(const struct task *task, FILE *answer_stream);
+/*
+ * Checks the answer from buf, *consumed is set to the count of bytes it took. ANSWER_MORE with bytes left
+ * means they are the beginning of the answer, call it again with them and the bytes that come after
+ */
+extern enum answer_state task_check_mem(const struct task *task, const char *buf, size_t len, size_t *consumed);
 extern void task_destroy(struct task *task);
 
 extern const char *question_get_text(const struct question *q);
+// The text is rcmem, it can be kept with rcmem_take after the question is destroyed
+extern bool question_text_is_rc(const struct question *q);
 extern void question_destroy(struct question *q);
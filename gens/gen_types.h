@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 
 struct gen {
@@ -12,10 +14,13 @@ struct task {
     void *priv;
     struct question *(*get_question)(void *priv);
     enum answer_state (*check)(void *priv, FILE *answer_stream);
+    // Optional, the same check straight from memory. See task_check_mem
+    enum answer_state (*check_mem)(void *priv, const char *buf, size_t len, size_t *consumed);
     void (*free_priv)(void *priv);
 };
 
 struct question {
     char *text;
     void (*free_text)(char *text);
+    bool text_rc;   // text is an rcmem block, holders may take their own references and outlive the question
 };
@@ -3,9 +3,11 @@
 #include "gen_types.h"
 #include "utils.h"
 #include "rcmem.h"
+#include "rand.h"
 #include <assert.h>
 #include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
 
 #define ANSWER_LEN 32
 
@@ -15,12 +17,6 @@ static const char python_shellcode[] =
 
 static const size_t python_shellcode_len = countof(python_shellcode) - 1; //without zero byte
 
-static void fill_rand_chars(char *str, size_t len) {
-    for ( size_t i = 0; i < len; i++ ) {
-        str[i] = (rand() % ('~' - '!' + 1)) + '!';
-    }
-}
-
 struct python_shellcode_task_priv {
     char *__rc text;
     bool text_cached;
@@ -57,6 +53,7 @@ static struct question *python_shellcode_get_question(void *p) {
 
     q->text = rcmem_take(priv->text);
     q->free_text = python_shellcode_free_text;
+    q->text_rc = true;
 
     return q;
 }
@@ -95,6 +92,37 @@ static enum answer_state python_shellcode_check(void *p, FILE *fp) {
     }
 }
 
+static enum answer_state python_shellcode_check_mem(void *p, const char *buf, size_t len, size_t *consumed) {
+    assert(p);
+    assert(buf);
+
+    struct python_shellcode_task_priv *priv = p;
+
+    // Answer chars are never whitespace, so it's the end of the previous line
+    size_t skipped = 0;
+    if ( priv->user_answer_len == 0 ) {
+        while ( skipped < len && isspace((unsigned char)buf[skipped]) ) skipped++;
+    }
+
+    size_t needed = ANSWER_LEN - priv->user_answer_len;
+    size_t taken = min(needed, len - skipped);
+    memcpy(shiftptr((char *)priv->user_answer, priv->user_answer_len), buf + skipped, taken);
+    *consumed = skipped + taken;
+
+    if ( taken < needed ) {
+        priv->user_answer_len += taken;
+        return ANSWER_MORE;
+    }
+
+    priv->user_answer_len = 0;
+
+    if ( !memcmp(priv->user_answer, priv->answer, ANSWER_LEN) ) {
+        return ANSWER_RIGHT;
+    } else {
+        return ANSWER_WRONG;
+    }
+}
+
 static struct task *python_shellcode_genenerate(void *p) {
     assert(p == NULL);
     unused(p);
@@ -105,7 +133,7 @@ static struct task *python_shellcode_genenerate(void *p) {
     struct python_shellcode_task_priv *task_priv = malloc(sizeof(struct python_shellcode_task_priv));
     if ( task_priv == NULL ) goto free_task;
 
-    fill_rand_chars(task_priv->answer, ANSWER_LEN);
+    rand_fill_chars(task_priv->answer, ANSWER_LEN, '!', '~');
 
     task_priv->text = NULL;
     task_priv->text_cached = false;
@@ -113,6 +141,7 @@ static struct task *python_shellcode_genenerate(void *p) {
 
     task->priv = task_priv;
     task->check = python_shellcode_check;
+    task->check_mem = python_shellcode_check_mem;
     task->get_question = python_shellcode_get_question;
     task->free_priv = python_shellcode_free_task_priv;
 
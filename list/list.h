@@ -122,16 +122,9 @@ static inline void list_unlink_list(struct list *item) {
 
 #define list_remove_item(head, tail, item, mmbr)              \
     ({                                                             \
-        if ( *(head) == *(tail) && *(head) == (item) ) { \
-            *(head) = NULL;                                    \
-            *(tail) = NULL;                                    \
-        } else if ( *(head) == (item) ) {                        \
-            *(head) = list_get_next((item), mmbr);               \
-        } else if ( *(tail) == (item) ) {                        \
-            *tail = list_get_prev((item), mmbr);               \
-        } else {                                                          \
-            list_unlink((item), mmbr);  \
-        } \
+        if ( *(head) == (item) ) *(head) = list_get_next((item), mmbr); \
+        if ( *(tail) == (item) ) *(tail) = list_get_prev((item), mmbr); \
+        list_unlink((item), mmbr);   /* The neighbours must not point to it anymore */ \
     })
 
 static inline bool list_is_empty_list(struct list *list) {
@@ -10,15 +10,44 @@
 #include "cli.h"
 #include "cli_convert.h"
 #include "log.h"
+#include "rcmem.h"
+#include "gens/eq_gen.h"
 #include "plots/troll_eq_plot.h"
 #include "server.h"
 
+static int cli_convert_balance_policy(const char *s, struct cli_opt_arg *out) {
+    enum server_balance_policy policy;
+    if ( server_balance_policy_from_name(s, &policy) ) return -1;
+
+    out->data.i = policy;
+    out->data_free = NULL;
+    return 0;
+}
+
+static int cli_convert_backend(const char *s, struct cli_opt_arg *out) {
+    enum server_backend backend;
+    if ( server_backend_from_name(s, &backend) ) return -1;
+
+    out->data.i = backend;
+    out->data_free = NULL;
+    return 0;
+}
+
 int main(int argc, char **argv) {
     log_set_file(stderr);
 
-    unsigned workers_nr = sysconf(_SC_NPROCESSORS_ONLN);
+    struct server_config config = {
+        .workers_nr = sysconf(_SC_NPROCESSORS_ONLN),
+        .flags = 0,
+        .accept_batch = 0,
+        .events_batch = 0,
+        .balance = SERVER_BALANCE_LEAST_CLIENTS,
+        .backend = SERVER_BACKEND_EPOLL,
+        .zerocopy_min = 0
+    };
     short unsigned port = 0;
     int log_lvl = LOG_WARN;
+    unsigned eq_pool = 0;
 
     log_set_flags(log_lvl);
 
@@ -52,6 +81,62 @@ int main(int argc, char **argv) {
          .flags = CLI_OPT_HAS_ARG,
          .parser = cli_convert_u,
          .description = "Number of worker threads",
+         },
+        {
+         .id = "reuseport",
+         .long_name = "reuseport",
+         .short_name = 'r',
+         .flags = 0,
+         .parser = NULL,
+         .description = "Accept connections on every worker with SO_REUSEPORT sockets",
+         },
+        {
+         .id = "accept_batch",
+         .long_name = "accept-batch",
+         .short_name = 'a',
+         .flags = CLI_OPT_HAS_ARG,
+         .parser = cli_convert_u,
+         .description = "Max connections accepted from one listener per wakeup",
+         },
+        {
+         .id = "events_batch",
+         .long_name = "events-batch",
+         .short_name = 'n',
+         .flags = CLI_OPT_HAS_ARG,
+         .parser = cli_convert_u,
+         .description = "Max epoll events a worker handles per wakeup",
+         },
+        {
+         .id = "balance",
+         .long_name = "balance",
+         .short_name = 'b',
+         .flags = CLI_OPT_HAS_ARG,
+         .parser = cli_convert_balance_policy,
+         .description = "Worker choice for new clients: least, rr, p2c or cost (ignored with --reuseport)",
+         },
+        {
+         .id = "backend",
+         .long_name = "backend",
+         .short_name = 'e',
+         .flags = CLI_OPT_HAS_ARG,
+         .parser = cli_convert_backend,
+         .description = "Worker event loop: epoll or uring (falls back to epoll without io_uring)",
+         },
+        {
+         .id = "zerocopy_min",
+         .long_name = "zerocopy-min",
+         .short_name = 'z',
+         .flags = CLI_OPT_HAS_ARG,
+         .parser = cli_convert_u,
+         .description = "Send question runs of at least this many bytes with MSG_ZEROCOPY, epoll only (0 is off)",
+         },
+        {
+         .id = "eq_pool",
+         .long_name = "eq-pool",
+         .short_name = 'q',
+         .flags = CLI_OPT_HAS_ARG,
+         .parser = cli_convert_u,
+         .description = "Eqs prepared ahead by a background thread, refilled below a half (0 generates them on demand)",
          }
     };
 
@@ -74,7 +159,21 @@ int main(int argc, char **argv) {
     arg = cli_match_get_arg(m, "port");
     if ( arg ) { port = arg->data.su; }
     arg = cli_match_get_arg(m, "workers_nr");
-    if ( arg ) { workers_nr = arg->data.u; }
+    if ( arg ) { config.workers_nr = arg->data.u; }
+    size_t args_nr;
+    if ( !cli_match_get_args_nr(m, "reuseport", &args_nr) ) { config.flags |= SERVER_REUSEPORT; }
+    arg = cli_match_get_arg(m, "accept_batch");
+    if ( arg ) { config.accept_batch = arg->data.u; }
+    arg = cli_match_get_arg(m, "events_batch");
+    if ( arg ) { config.events_batch = arg->data.u; }
+    arg = cli_match_get_arg(m, "balance");
+    if ( arg ) { config.balance = arg->data.i; }
+    arg = cli_match_get_arg(m, "backend");
+    if ( arg ) { config.backend = arg->data.i; }
+    arg = cli_match_get_arg(m, "zerocopy_min");
+    if ( arg ) { config.zerocopy_min = arg->data.u; }
+    arg = cli_match_get_arg(m, "eq_pool");
+    if ( arg ) { eq_pool = arg->data.u; }
 
     cli_match_destroy(m);
     cli_remove_opt(cli, "port");
@@ -82,7 +181,12 @@ int main(int argc, char **argv) {
 
     log_set_flags(log_lvl);
 
-    struct server *server = server_create(workers_nr);
+    if ( eq_pool != 0 && troll_eq_plot_start_pool(eq_pool) ) {
+        log_msg(LOG_CRITICAL, "Failed to start the eq pool\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct server *server = server_create(&config);
     if ( server == NULL ) {
         log_msg(LOG_CRITICAL, "Failed to launch server\n");
         exit(EXIT_FAILURE);
@@ -104,7 +208,43 @@ int main(int argc, char **argv) {
     assert(sig == SIGINT);
 
     log_msg(LOG_INFO, "Shutting down the server\n");
+
+    struct server_accept_stats as;
+    server_get_accept_stats(server, &as);
+    log_msg(
+        LOG_INFO, "Accepted %lu connections in %lu wakeups (%.2f per wakeup, max %lu)\n", as.accepted, as.wakeups,
+        as.wakeups ? (double)as.accepted / as.wakeups : 0.0, as.max_batch
+    );
+
+    struct slab_stats alloc_stats;
+    server_get_alloc_stats(server, &alloc_stats);
+    log_msg(
+        LOG_INFO, "Allocated %lu clients from %lu slabs (peak %lu at once)\n", alloc_stats.allocs, alloc_stats.slabs,
+        alloc_stats.peak_objs
+    );
+
     server_destroy(server);
+
+    struct eq_pool_stats eq_stats;
+    if ( !troll_eq_plot_get_pool_stats(&eq_stats) ) {
+        log_msg(
+            LOG_INFO, "Eq pool: %lu hits, %lu misses, %lu generated in %lu refills\n", eq_stats.hits, eq_stats.misses,
+            eq_stats.generated, eq_stats.refills
+        );
+    }
+    troll_eq_plot_stop_pool();
+
+    struct rcmem_class_stats rc_stats[RCMEM_CLASSES_NR];
+    unsigned rc_classes = rcmem_get_stats(rc_stats, countof(rc_stats));
+    for ( unsigned i = 0; i < rc_classes; i++ ) {
+        if ( rc_stats[i].heap_allocs == 0 ) continue;
+        log_msg(
+            LOG_INFO, "rcmem %zu byte blocks: peak %lu, %lu taken from malloc\n", rc_stats[i].size,
+            rc_stats[i].peak_blocks, rc_stats[i].heap_allocs
+        );
+    }
+    rcmem_pool_trim();
+
     log_msg(LOG_INFO, "The server was shut down\n");
     exit(EXIT_SUCCESS);
 }
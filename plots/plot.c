@@ -30,6 +30,12 @@ enum answer_state plot_task_check(const struct plot_task *pt, FILE *fp) {
     return task_check(pt->gen_task, fp);
 }
 
+enum answer_state plot_task_check_mem(const struct plot_task *pt, const char *buf, size_t len, size_t *consumed) {
+    assert(pt);
+    assert(pt->gen_task);
+    return task_check_mem(pt->gen_task, buf, len, consumed);
+}
+
 unsigned long plot_task_get_timeout_msec(const struct plot_task *pt) {
     assert(pt);
     return pt->msec_timemout;
@@ -16,5 +16,6 @@ extern void plot_destroy(struct plot *plot);
 
 extern struct question *plot_task_get_question(struct plot_task *pt);
 extern enum answer_state plot_task_check(const struct plot_task *pt, FILE *fp);
+extern enum answer_state plot_task_check_mem(const struct plot_task *pt, const char *buf, size_t len, size_t *consumed);
 extern unsigned long plot_task_get_timeout_msec(const struct plot_task *pt);
 extern void plot_task_destroy(struct plot_task *pt);
@@ -44,9 +44,9 @@ static struct plot_task *linear_plot_get_task(void *priv) {
     if ( pt == NULL ) goto destroy_task;
 
     pt->gen_task = task;
-    pt->msec_timemout = cur_member->timeout_base - cur_member->task_count * cur_member->timeout_dec;
+    pt->msec_timemout = cur_member->timeout_base - p->cur_task_nr * cur_member->timeout_dec;
 
-    assert(pt->msec_timemout >= cur_member->timeout_base); //overflow check
+    assert(pt->msec_timemout <= cur_member->timeout_base); //overflow check
 
     p->cur_task_nr++;
     if ( cur_member->task_count == p->cur_task_nr ) {
@@ -75,10 +75,10 @@ struct plot *linear_plot_create(struct linear_plot_member *membs, unsigned long
     if ( lpp->members == NULL ) goto free_lpp;
 
     for ( unsigned long i = 0; i < members_count; i++ ) {
-        lpp->members[i].gen = membs->gen; //move the gens
-        lpp->members[i].task_count = membs->task_count;
-        lpp->members[i].timeout_base = membs->timeout_base;
-        lpp->members[i].timeout_dec = membs->timeout_dec;
+        lpp->members[i].gen = membs[i].gen; //move the gens
+        lpp->members[i].task_count = membs[i].task_count;
+        lpp->members[i].timeout_base = membs[i].timeout_base;
+        lpp->members[i].timeout_dec = membs[i].timeout_dec;
     }
     lpp->members_count = members_count;
     lpp->cur_member_index = 0;
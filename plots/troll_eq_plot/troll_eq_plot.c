@@ -1,3 +1,4 @@
+#include <assert.h>
 #include "gen.h"
 #include "gens/eq_gen.h"
 #include "gens/echo_gen.h"
@@ -6,8 +7,38 @@
 #include "plot_types.h"
 #include "templates/linear_plot_template/linear_plot_template.h"
 
+#define TROLL_EQ_MINLEN 1
+#define TROLL_EQ_MAXLEN 1000
+#define TROLL_EQ_MAXNR 1000000
+
+static struct eq_pool *troll_eq_pool;   // Shared by the eq gens of all clients if started
+
+int troll_eq_plot_start_pool(unsigned capacity) {
+    assert(troll_eq_pool == NULL);
+
+    troll_eq_pool = eq_pool_create(
+        TROLL_EQ_MINLEN, TROLL_EQ_MAXLEN, TROLL_EQ_MAXNR, EQ_ELEM_ALL, capacity, capacity / 2
+    );
+    return troll_eq_pool == NULL ? -1 : 0;
+}
+
+void troll_eq_plot_stop_pool(void) {
+    if ( troll_eq_pool == NULL ) return;
+
+    eq_pool_destroy(troll_eq_pool);
+    troll_eq_pool = NULL;
+}
+
+int troll_eq_plot_get_pool_stats(struct eq_pool_stats *out) {
+    if ( troll_eq_pool == NULL ) return -1;
+
+    eq_pool_get_stats(troll_eq_pool, out);
+    return 0;
+}
+
 struct plot *troll_eq_plot_create() {
-    struct gen *eq_gen = eq_gen_create(1, 1000, 1000000, EQ_ELEM_ALL);
+    struct gen *eq_gen = troll_eq_pool != NULL ? eq_gen_create_pooled(troll_eq_pool)
+                                               : eq_gen_create(TROLL_EQ_MINLEN, TROLL_EQ_MAXLEN, TROLL_EQ_MAXNR, EQ_ELEM_ALL);
     if ( eq_gen == NULL ) goto fail;
 
     struct gen *python_shellcode_gen = python_shellcode_gen_create();
@@ -1,4 +1,15 @@
 #pragma once
 
+struct eq_pool_stats;
+
 [[gnu::malloc]]
 extern struct plot *troll_eq_plot_create();
+
+/*
+ * Optional, eqs for all clients are prepared by a background thread then. Start it before the plot serves
+ * anybody and stop it when all the plots are destroyed
+ */
+extern int troll_eq_plot_start_pool(unsigned capacity);
+extern void troll_eq_plot_stop_pool(void);
+// -1 if the pool isn't started
+extern int troll_eq_plot_get_pool_stats(struct eq_pool_stats *out);
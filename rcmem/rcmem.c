@@ -1,11 +1,16 @@
 #include "rcmem.h"
+#include <stdbool.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include "log.h"
 #include "utils.h"
 
 struct rcmem_hdr {
-    unsigned counter;
+    unsigned counter;   // Atomic for shared blocks
+    bool shared;
+    unsigned char class;   // RCMEM_CLASS_NONE for blocks straight from malloc
 };
 
 struct rcmem {
@@ -15,23 +20,256 @@ struct rcmem {
 
 #define rcmem_get_mem(m) (&(m)->mem_start)
 
-extern void *rcmem_alloc(size_t size) {
+/*
+ * Blocks up to RCMEM_CLASS_MAX usable bytes come in power of two classes. Every thread keeps free blocks of each
+ * class in a magazine and exchanges RCMEM_MAGAZINE_BATCH of them at once with the shared depot when the magazine
+ * runs empty or full, so the mutex and malloc are only touched once per batch
+ */
+#define RCMEM_CLASS_MIN ((size_t)32)
+#define RCMEM_CLASS_MAX ((size_t)4096)
+_Static_assert((RCMEM_CLASS_MIN << (RCMEM_CLASSES_NR - 1)) == RCMEM_CLASS_MAX, "RCMEM_CLASSES_NR doesn't match");
+#define RCMEM_CLASS_NONE 0xff
+
+#define RCMEM_MAGAZINE_BATCH 32
+#define RCMEM_DEPOT_BATCHES 64   // Per class, batches above it go back to malloc
+
+// A free block, its memory links it into a magazine and the first block of a batch links the batch into the depot
+struct rcmem_free {
+    struct rcmem *next;
+    struct rcmem *next_batch;
+    unsigned batch_nr;
+};
+
+struct rcmem_magazine {
+    struct rcmem *top;
+    unsigned nr;
+};
+
+struct rcmem_depot {
+    pthread_mutex_t mtx;
+    struct rcmem *batches;
+    unsigned batches_nr;
+    struct rcmem_class_stats stats;   // Atomic
+};
+
+static __thread struct rcmem_magazine rcmem_magazines[RCMEM_CLASSES_NR];
+
+static struct rcmem_depot rcmem_depots[RCMEM_CLASSES_NR] = {
+    [0 ... RCMEM_CLASSES_NR - 1] = {.mtx = PTHREAD_MUTEX_INITIALIZER}
+};
+
+#define rcmem_free_of(m) ((struct rcmem_free *)rcmem_get_mem(m))
+
+static size_t rcmem_class_size(unsigned class) {
+    return RCMEM_CLASS_MIN << class;
+}
+
+static unsigned rcmem_class(size_t size) {
+    if ( size > RCMEM_CLASS_MAX ) return RCMEM_CLASS_NONE;
+
+    unsigned class = 0;
+    while ( rcmem_class_size(class) < size ) class++;
+    return class;
+}
+
+static void rcmem_stats_add_blocks(struct rcmem_class_stats *stats, unsigned long nr) {
+    unsigned long blocks = __atomic_add_fetch(&stats->blocks, nr, __ATOMIC_RELAXED);
+
+    unsigned long peak = __atomic_load_n(&stats->peak_blocks, __ATOMIC_RELAXED);
+    while ( blocks > peak ) {
+        if ( __atomic_compare_exchange_n(&stats->peak_blocks, &peak, blocks, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+            break;
+    }
+}
+
+static void rcmem_free_chain(struct rcmem *m) {
+    while ( m != NULL ) {
+        struct rcmem *next = rcmem_free_of(m)->next;
+        free(m);
+        m = next;
+    }
+}
+
+// Refills an empty magazine from the depot, false if the depot has nothing
+static bool rcmem_depot_take(unsigned class, struct rcmem_magazine *mag) {
+    struct rcmem_depot *depot = &rcmem_depots[class];
+
+    pthread_mutex_lock(&depot->mtx);
+    struct rcmem *batch = depot->batches;
+    if ( batch != NULL ) {
+        depot->batches = rcmem_free_of(batch)->next_batch;
+        depot->batches_nr--;
+        __atomic_sub_fetch(&depot->stats.depot_blocks, rcmem_free_of(batch)->batch_nr, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&depot->mtx);
+
+    if ( batch == NULL ) return false;
+
+    mag->top = batch;
+    mag->nr = rcmem_free_of(batch)->batch_nr;
+    return true;
+}
+
+// Gives a chain of nr free blocks to the depot
+static void rcmem_depot_give(unsigned class, struct rcmem *batch, unsigned nr) {
+    struct rcmem_depot *depot = &rcmem_depots[class];
+
+    rcmem_free_of(batch)->batch_nr = nr;
+
+    pthread_mutex_lock(&depot->mtx);
+    bool keep = depot->batches_nr < RCMEM_DEPOT_BATCHES;
+    if ( keep ) {
+        rcmem_free_of(batch)->next_batch = depot->batches;
+        depot->batches = batch;
+        depot->batches_nr++;
+        __atomic_add_fetch(&depot->stats.depot_blocks, nr, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&depot->mtx);
+
+    if ( !keep ) {
+        rcmem_free_chain(batch);
+        __atomic_sub_fetch(&depot->stats.blocks, nr, __ATOMIC_RELAXED);
+    }
+}
+
+static struct rcmem *rcmem_block_alloc(size_t size) {
+    unsigned class = rcmem_class(size);
+    if ( class == RCMEM_CLASS_NONE ) {
+        struct rcmem *m = malloc(offsetof(struct rcmem, mem_start) + size);   // The caller checked the overflow
+        if ( m != NULL ) m->hdr.class = RCMEM_CLASS_NONE;
+        return m;
+    }
+
+    struct rcmem_magazine *mag = &rcmem_magazines[class];
+    if ( mag->nr == 0 && !rcmem_depot_take(class, mag) ) {
+        struct rcmem_depot *depot = &rcmem_depots[class];
+        __atomic_add_fetch(&depot->stats.heap_allocs, 1, __ATOMIC_RELAXED);
+
+        struct rcmem *m = malloc(offsetof(struct rcmem, mem_start) + rcmem_class_size(class));
+        if ( m == NULL ) return NULL;
+
+        rcmem_stats_add_blocks(&depot->stats, 1);
+        m->hdr.class = class;
+        return m;
+    }
+
+    struct rcmem *m = mag->top;
+    mag->top = rcmem_free_of(m)->next;
+    mag->nr--;
+    return m;
+}
+
+static void rcmem_block_free(struct rcmem *m) {
+    unsigned class = m->hdr.class;
+    if ( class == RCMEM_CLASS_NONE ) {
+        free(m);
+        return;
+    }
+
+    struct rcmem_magazine *mag = &rcmem_magazines[class];
+    rcmem_free_of(m)->next = mag->top;
+    mag->top = m;
+    mag->nr++;
+
+    if ( mag->nr < 2 * RCMEM_MAGAZINE_BATCH ) return;
+
+    // Full, the older half goes to the depot, the hot half stays
+    struct rcmem *last_kept = mag->top;
+    for ( unsigned i = 1; i < RCMEM_MAGAZINE_BATCH; i++ ) last_kept = rcmem_free_of(last_kept)->next;
+
+    struct rcmem *batch = rcmem_free_of(last_kept)->next;
+    rcmem_free_of(last_kept)->next = NULL;
+    mag->nr = RCMEM_MAGAZINE_BATCH;
+
+    rcmem_depot_give(class, batch, RCMEM_MAGAZINE_BATCH);
+}
+
+void rcmem_pool_flush(void) {
+    for ( unsigned class = 0; class < RCMEM_CLASSES_NR; class++ ) {
+        struct rcmem_magazine *mag = &rcmem_magazines[class];
+        if ( mag->nr == 0 ) continue;
+
+        rcmem_depot_give(class, mag->top, mag->nr);
+        mag->top = NULL;
+        mag->nr = 0;
+    }
+}
+
+void rcmem_pool_trim(void) {
+    rcmem_pool_flush();
+
+    for ( unsigned class = 0; class < RCMEM_CLASSES_NR; class++ ) {
+        struct rcmem_depot *depot = &rcmem_depots[class];
+
+        pthread_mutex_lock(&depot->mtx);
+        struct rcmem *batches = depot->batches;
+        depot->batches = NULL;
+        depot->batches_nr = 0;
+        __atomic_store_n(&depot->stats.depot_blocks, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&depot->mtx);
+
+        while ( batches != NULL ) {
+            struct rcmem *next_batch = rcmem_free_of(batches)->next_batch;
+            unsigned nr = rcmem_free_of(batches)->batch_nr;
+
+            rcmem_free_chain(batches);
+            __atomic_sub_fetch(&depot->stats.blocks, nr, __ATOMIC_RELAXED);
+            batches = next_batch;
+        }
+    }
+}
+
+unsigned rcmem_get_stats(struct rcmem_class_stats *out, unsigned nr) {
+    nr = min(nr, (unsigned)RCMEM_CLASSES_NR);
+
+    for ( unsigned class = 0; class < nr; class++ ) {
+        struct rcmem_class_stats *stats = &rcmem_depots[class].stats;
+        out[class].size = rcmem_class_size(class);
+        out[class].blocks = __atomic_load_n(&stats->blocks, __ATOMIC_RELAXED);
+        out[class].peak_blocks = __atomic_load_n(&stats->peak_blocks, __ATOMIC_RELAXED);
+        out[class].depot_blocks = __atomic_load_n(&stats->depot_blocks, __ATOMIC_RELAXED);
+        out[class].heap_allocs = __atomic_load_n(&stats->heap_allocs, __ATOMIC_RELAXED);
+    }
+
+    return nr;
+}
+
+static void *rcmem_alloc_hdr(size_t size, bool shared) {
     size_t total_size;
     if ( ckd_add(&total_size, size, offsetof(struct rcmem, mem_start)) ) return NULL;
 
-    struct rcmem *mem = malloc(total_size);
+    struct rcmem *mem = rcmem_block_alloc(size);
     if ( mem == NULL ) return NULL;
 
     mem->hdr.counter = 1;
+    mem->hdr.shared = shared;
     return rcmem_get_mem(mem);
 }
 
+extern void *rcmem_alloc(size_t size) {
+    return rcmem_alloc_hdr(size, false);
+}
+
+extern void *rcmem_alloc_shared(size_t size) {
+    return rcmem_alloc_hdr(size, true);
+}
+
+static void rcmem_overflow(void *mem) {
+    log_msg(LOG_CRITICAL, "Reference counted memory on %p overflowed its reference counter\n", mem);
+    assert(0);
+}
+
 extern void *rcmem_take(void *mem) {
     struct rcmem *m = containerof(struct rcmem, mem, mem_start);
 
+    if ( m->hdr.shared ) {
+        // A new reference comes from an existing one, nothing to order
+        if ( __atomic_fetch_add(&m->hdr.counter, 1u, __ATOMIC_RELAXED) == UINT_MAX ) rcmem_overflow(mem);
+        return rcmem_get_mem(m);
+    }
+
     if ( ckd_add(&m->hdr.counter, m->hdr.counter, 1u) ) {
-        log_msg(LOG_CRITICAL, "Reference counted memory on %p overflowed its reference counter\n", mem);
-        assert(0);
+        rcmem_overflow(mem);
     }
 
     return rcmem_get_mem(m);
@@ -40,10 +278,21 @@ extern void *rcmem_take(void *mem) {
 extern void rcmem_put(void *mem) {
     struct rcmem *m = containerof(struct rcmem, mem, mem_start);
 
+    if ( m->hdr.shared ) {
+        // Writes through every other reference happen before the free
+        if ( __atomic_fetch_sub(&m->hdr.counter, 1u, __ATOMIC_ACQ_REL) == 1 ) rcmem_block_free(m);
+        return;
+    }
+
     if (m->hdr.counter == 1) {
-        free(m);
+        rcmem_block_free(m);
         return;
     }
 
     m->hdr.counter--;
 }
+
+unsigned rcmem_refs(const void *mem) {
+    const struct rcmem *m = containerof(const struct rcmem, mem, mem_start);
+    return __atomic_load_n(&m->hdr.counter, __ATOMIC_RELAXED);
+}
@@ -11,5 +11,29 @@
 })
 
 extern void *rcmem_alloc(size_t size);
+// The counter of a shared block is atomic, its references may be taken and put on any thread
+extern void *rcmem_alloc_shared(size_t size);
 extern void *rcmem_take(void *mem);
 extern void rcmem_put(void *mem);
+// The current count of references, for tests and asserts. Racy if other threads take or put them meanwhile
+extern unsigned rcmem_refs(const void *mem);
+
+/*
+ * Small blocks come from per-thread magazines backed by a shared depot, see rcmem.c. Threads that used rcmem
+ * flush their magazines to the depot before they exit, trim gives the depot and the caller's magazines to malloc
+ */
+extern void rcmem_pool_flush(void);
+extern void rcmem_pool_trim(void);
+
+#define RCMEM_CLASSES_NR 8   // Power of two classes from 32 to 4096 bytes
+
+struct rcmem_class_stats {
+    size_t size;                  // Usable bytes of the class blocks
+    unsigned long blocks;         // Taken from malloc, in use or free in the magazines and the depot
+    unsigned long peak_blocks;
+    unsigned long depot_blocks;   // Free in the depot, blocks - depot_blocks are in use or in thread magazines
+    unsigned long heap_allocs;    // Allocations that found the magazine and the depot empty
+};
+
+// Fills up to nr classes from the smallest, returns the filled count
+extern unsigned rcmem_get_stats(struct rcmem_class_stats *out, unsigned nr);
@@ -0,0 +1,65 @@
+#include "rcmem.h"
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define FAIL() exit(EXIT_FAILURE)
+#define PASS() exit(EXIT_SUCCESS)
+
+#define THREADS_NR 8
+#define ROUNDS_NR 64
+#define TAKES_NR 10000
+
+static pthread_barrier_t started, hammered, checked;
+
+// Every thread gets one reference from main and drops it after the check, so the last put lands on any of them
+static void *hammer(void *mem) {
+    pthread_barrier_wait(&started);   // All at once, so the takes and puts overlap
+    for ( unsigned i = 0; i < TAKES_NR; i++ ) rcmem_put(rcmem_take(mem));
+
+    pthread_barrier_wait(&hammered);
+    pthread_barrier_wait(&checked);
+    rcmem_put(mem);
+
+    rcmem_pool_flush();   // The block may be in our magazine
+    return NULL;
+}
+
+int main() {
+    if ( pthread_barrier_init(&started, NULL, THREADS_NR) ) FAIL();
+    if ( pthread_barrier_init(&hammered, NULL, THREADS_NR + 1) ) FAIL();
+    if ( pthread_barrier_init(&checked, NULL, THREADS_NR + 1) ) FAIL();
+
+    for ( unsigned round = 0; round < ROUNDS_NR; round++ ) {
+        char *mem = rcmem_alloc_shared(16);
+        if ( mem == NULL ) FAIL();
+        memset(mem, 'q', 16);
+
+        pthread_t threads[THREADS_NR];
+        for ( unsigned i = 0; i < THREADS_NR; i++ ) {
+            if ( pthread_create(&threads[i], NULL, hammer, rcmem_take(mem)) ) FAIL();
+        }
+
+        pthread_barrier_wait(&hammered);
+        if ( rcmem_refs(mem) != THREADS_NR + 1 ) FAIL();
+        pthread_barrier_wait(&checked);
+        rcmem_put(mem);
+
+        for ( unsigned i = 0; i < THREADS_NR; i++ ) {
+            if ( pthread_join(threads[i], NULL) ) FAIL();
+        }
+    }
+    rcmem_pool_flush();
+
+    // Each block was freed exactly once if all of them are back in the depot, a double free would count twice
+    struct rcmem_class_stats stats[RCMEM_CLASSES_NR];
+    rcmem_get_stats(stats, RCMEM_CLASSES_NR);
+    if ( stats[0].blocks == 0 || stats[0].depot_blocks != stats[0].blocks ) FAIL();
+
+    rcmem_pool_trim();
+    pthread_barrier_destroy(&started);
+    pthread_barrier_destroy(&hammered);
+    pthread_barrier_destroy(&checked);
+
+    PASS();
+}
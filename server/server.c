@@ -2,7 +2,6 @@
 #include "server.h"
 #include <assert.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <stdlib.h>
@@ -11,18 +10,25 @@
 #include <unistd.h>
 #include "listc.h"
 #include "log.h"
+#include "server_accept.h"
 #include "server_worker.h"
+#include "utils.h"
 
 struct plot_socket {
-    int sockfd;
+    int *sockfds;   // One socket for the main thread or one SO_REUSEPORT socket per worker
+    unsigned sockfds_nr;
     plot_constructor_t pc;
     unsigned short port;
     struct listc plot_socket_ring;
     bool active;
 };
 
+#define SERVER_EPOLL_EVENTS_NR 16
+
 struct server {
     int epfd;
+    struct server_config config;
+    struct server_accept_stats accept_stats;
     pthread_t main_thread;
     struct plot_socket *plot_sockets;
     pthread_mutex_t plot_sockets_mtx;
@@ -32,14 +38,19 @@ struct server {
     struct server_worker_pool *pool;
 };
 
+static void plot_socket_destroy(struct plot_socket *ps) {
+    free(ps->sockfds);
+    free(ps);
+}
+
 static void server_cleanup_inactive_plot_sockets(struct server *server) {
     pthread_mutex_lock(&server->inactive_plot_sockets_mtx);
     if ( server->inactive_plot_sockets != NULL ) {
         struct plot_socket *iter = server->inactive_plot_sockets;
         do {
             struct plot_socket *next = listc_get_next(iter, plot_socket_ring);
-            assert(iter->sockfd == -1);
-            free(iter);
+            assert(iter->sockfds[0] == -1);
+            plot_socket_destroy(iter);
             iter = next;
         } while ( iter != server->inactive_plot_sockets );
         server->inactive_plot_sockets = NULL;
@@ -47,10 +58,23 @@ static void server_cleanup_inactive_plot_sockets(struct server *server) {
     pthread_mutex_unlock(&server->inactive_plot_sockets_mtx);
 }
 
+struct server_accept_ctx {
+    struct server *server;
+    struct plot_socket *ps;
+};
+
+static int server_accept_handler(void *arg, int clientfd) {
+    struct server_accept_ctx *ctx = arg;
+    if ( server_worker_pool_add_client(ctx->server->pool, clientfd, ctx->ps->pc) ) return -1;
+
+    log_msg(LOG_INFO, "New connection\n");
+    return 0;
+}
+
 [[noreturn]]
 static void *server_main_thread_loop(void *arg) {
     struct server *serv = arg;
-    struct epoll_event ev;
+    struct epoll_event evs[SERVER_EPOLL_EVENTS_NR];
 
     while ( true ) {
         int res;
@@ -61,7 +85,7 @@ static void *server_main_thread_loop(void *arg) {
          * ATTENTION!!!
          */
 retry:
-        res = epoll_wait(serv->epfd, &ev, 1, -1);
+        res = epoll_wait(serv->epfd, evs, countof(evs), -1);
         if ( res == -1 ) {
             if ( errno == EINTR ) goto retry;
         }
@@ -70,47 +94,43 @@ retry:
         pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
         pthread_mutex_lock(&serv->plot_sockets_mtx);
-        struct plot_socket *ps = ev.data.ptr;
 
-        if ( !ps->active ) {   // Plot socket is going to destroy
-            server_cleanup_inactive_plot_sockets(serv);
-            pthread_mutex_unlock(&serv->plot_sockets_mtx);
-            continue;
-        }
+        unsigned accepted = 0;
+        for ( int i = 0; i < res; i++ ) {
+            struct plot_socket *ps = evs[i].data.ptr;
 
-        // If we had done cleanup before ps active check, we'd have cleared our ps if it is inactive, which cause to UAF
-        // Here we cleanup inactive plot sockets, if the current plot socket is active
-        server_cleanup_inactive_plot_sockets(serv);
+            if ( !ps->active ) continue;   // Plot socket is going to destroy
 
-        assert(ev.events == EPOLLIN);
+            assert(evs[i].events == EPOLLIN);
 
-        int clientfd = accept(ps->sockfd, NULL, 0);
-        if ( clientfd == -1 ) {
-            log_msg(LOG_WARN, "Failed to accept connection\n");
-            pthread_mutex_unlock(&serv->plot_sockets_mtx);
-            continue;
+            struct server_accept_ctx ctx = {.server = serv, .ps = ps};
+            accepted += server_accept_batch(ps->sockfds[0], serv->config.accept_batch, server_accept_handler, &ctx);
         }
 
-        if ( server_worker_pool_add_client(serv->pool, clientfd, ps->pc) ) {
-            log_msg(LOG_WARN, "Failed to bind client\n");
-            close(clientfd);
-            pthread_mutex_unlock(&serv->plot_sockets_mtx);
-            continue;
-        }
-
-        log_msg(LOG_INFO, "New connection\n");
+        // If we had done cleanup inside the loop, we'd have cleared plot sockets the rest of evs point to (UAF)
+        // Here no event references inactive plot sockets anymore
+        server_cleanup_inactive_plot_sockets(serv);
         pthread_mutex_unlock(&serv->plot_sockets_mtx);
+
+        server_accept_stats_account(&serv->accept_stats, accepted);
     }
 
     assert(0);
     pthread_exit(NULL);
 }
 
-struct server *server_create(unsigned wq_workers_nr) {
+struct server *server_create(const struct server_config *config) {
+    assert(config);
+
     struct server *server = malloc(sizeof(struct server));
     if ( server == NULL ) return NULL;
 
-    server->pool = server_worker_pool_create(wq_workers_nr);
+    server->config = *config;
+    if ( server->config.accept_batch == 0 ) server->config.accept_batch = SERVER_ACCEPT_BATCH_DEFAULT;
+    if ( server->config.events_batch == 0 ) server->config.events_batch = SERVER_EVENTS_BATCH_DEFAULT;
+    server->accept_stats = (struct server_accept_stats){0};
+
+    server->pool = server_worker_pool_create(&server->config);
     if ( server->pool == NULL ) goto free_server;
 
     server->plot_sockets = NULL;
@@ -140,47 +160,91 @@ free_server:
     return NULL;
 }
 
+static int server_open_plot_socket(unsigned short port, bool reuseport) {
+    // Acceptors drain the backlog until EAGAIN, so the listening socket must be nonblocking
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ( sockfd == -1 ) return -1;
+
+    if ( reuseport ) {
+        int one = 1;
+        if ( setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) ) goto close_sockfd;
+    }
+
+    struct sockaddr_in sin = {.sin_addr = {INADDR_ANY}, .sin_port = htons(port), .sin_family = AF_INET};
+
+    if ( bind(sockfd, &sin, sizeof(sin)) ) goto close_sockfd;
+
+    if ( listen(sockfd, SOMAXCONN) ) goto close_sockfd;
+
+    return sockfd;
+
+close_sockfd:
+    close(sockfd);
+    return -1;
+}
+
 int server_add_plot(struct server *server, plot_constructor_t pc, unsigned short port) {
     struct plot_socket *ps = malloc(sizeof(struct plot_socket));
     if ( ps == NULL ) return -1;
 
+    bool reuseport = server->config.flags & SERVER_REUSEPORT;
+
     ps->active = true;
     ps->port = port;
     ps->pc = pc;
     listc_init(ps, plot_socket_ring);
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if ( sockfd == -1 ) goto free_ps;
 
-    struct sockaddr_in sin = {.sin_addr = {INADDR_ANY}, .sin_port = htons(port), .sin_family = AF_INET};
-
-    if ( bind(sockfd, &sin, sizeof(sin)) ) goto close_sockfd;
+    ps->sockfds_nr = reuseport ? server_worker_pool_get_workers_nr(server->pool) : 1;
+    ps->sockfds = malloc(sizeof(int) * ps->sockfds_nr);
+    if ( ps->sockfds == NULL ) goto free_ps;
+
+    struct sockaddr_in sin;
+    socklen_t scl;
+    unsigned short bound_port = port;
+    unsigned opened = 0;
+    for ( ; opened < ps->sockfds_nr; opened++ ) {
+        ps->sockfds[opened] = server_open_plot_socket(bound_port, reuseport);
+        if ( ps->sockfds[opened] == -1 ) goto close_sockfds;
+
+        if ( opened == 0 ) {   // Port 0 means "any port", but every shard has to listen to the same one
+            scl = sizeof(sin);
+            if ( getsockname(ps->sockfds[0], &sin, &scl) ) goto close_sockfds;   // get real port number
+            bound_port = ntohs(sin.sin_port);
+        }
+    }
 
-    if ( listen(sockfd, SOMAXCONN) ) goto close_sockfd;
+    if ( reuseport ) {
+        // Every worker accepts on its own socket, so the main thread doesn't see this plot at all
+        for ( unsigned i = 0; i < ps->sockfds_nr; i++ ) {
+            if ( server_worker_pool_add_listener(server->pool, i, ps->sockfds[i], pc) ) {
+                for ( unsigned j = 0; j < i; j++ ) server_worker_pool_remove_listener(server->pool, j, ps->sockfds[j]);
+                goto close_sockfds;
+            }
+        }
 
-    ps->sockfd = sockfd;
+        pthread_mutex_lock(&server->plot_sockets_mtx);
+        listc_add_item_back(&server->plot_sockets, ps, plot_socket_ring);
+        pthread_mutex_unlock(&server->plot_sockets_mtx);
+    } else {
+        pthread_mutex_lock(&server->plot_sockets_mtx);
 
-    pthread_mutex_lock(&server->plot_sockets_mtx);
+        struct epoll_event ev = {.data.ptr = ps, .events = EPOLLIN};
 
-    struct epoll_event ev = {.data.ptr = ps, .events = EPOLLIN};
+        if ( epoll_ctl(server->epfd, EPOLL_CTL_ADD, ps->sockfds[0], &ev) ) {
+            pthread_mutex_unlock(&server->plot_sockets_mtx);
+            goto close_sockfds;
+        }
 
-    if ( epoll_ctl(server->epfd, EPOLL_CTL_ADD, ps->sockfd, &ev) ) {
+        listc_add_item_back(&server->plot_sockets, ps, plot_socket_ring);
         pthread_mutex_unlock(&server->plot_sockets_mtx);
-        goto close_sockfd;
     }
 
-    listc_add_item_back(&server->plot_sockets, ps, plot_socket_ring);
-    pthread_mutex_unlock(&server->plot_sockets_mtx);
-
-    socklen_t scl = sizeof(sin);
-    if ( getsockname(sockfd, &sin, &scl) ) { //get real port number
-        log_msg(LOG_WARN, "Failed to retrieve socket information\n");
-    } else {
-        log_msg(LOG_INFO, "Plot socket on port %hu was created\n", ntohs(sin.sin_port));
-    }
+    log_msg(LOG_INFO, "Plot socket on port %hu was created (%u listening sockets)\n", bound_port, ps->sockfds_nr);
     return 0;
 
-close_sockfd:
-    close(sockfd);
+close_sockfds:
+    for ( unsigned i = 0; i < opened; i++ ) close(ps->sockfds[i]);
+    free(ps->sockfds);
 free_ps:
     free(ps);
     return -1;
@@ -194,9 +258,17 @@ int server_remove_plot(struct server *server, unsigned short port) {
         struct plot_socket *iter = server->plot_sockets;
         do {
             if ( iter->port == port ) {
-                epoll_ctl(server->epfd, EPOLL_CTL_DEL, iter->sockfd, NULL);
-                close(iter->sockfd);
-                iter->sockfd = -1;
+                if ( server->config.flags & SERVER_REUSEPORT ) {
+                    for ( unsigned i = 0; i < iter->sockfds_nr; i++ )
+                        server_worker_pool_remove_listener(server->pool, i, iter->sockfds[i]);
+                } else {
+                    epoll_ctl(server->epfd, EPOLL_CTL_DEL, iter->sockfds[0], NULL);
+                }
+
+                for ( unsigned i = 0; i < iter->sockfds_nr; i++ ) {
+                    close(iter->sockfds[i]);
+                    iter->sockfds[i] = -1;
+                }
                 iter->active = false;
                 listc_remove_item(&server->plot_sockets, iter, plot_socket_ring);
 
@@ -207,6 +279,7 @@ int server_remove_plot(struct server *server, unsigned short port) {
                 pthread_mutex_unlock(&server->plot_sockets_mtx);
                 return 0;
             }
+            iter = listc_get_next(iter, plot_socket_ring);
         } while ( iter != server->plot_sockets );
     }
     pthread_mutex_unlock(&server->plot_sockets_mtx);
@@ -214,6 +287,23 @@ int server_remove_plot(struct server *server, unsigned short port) {
     return -1;
 }
 
+void server_get_accept_stats(struct server *server, struct server_accept_stats *out) {
+    assert(server);
+    assert(out);
+
+    *out = (struct server_accept_stats){0};
+    server_accept_stats_merge(out, &server->accept_stats);
+    server_worker_pool_merge_accept_stats(server->pool, out);
+}
+
+void server_get_alloc_stats(struct server *server, struct slab_stats *out) {
+    assert(server);
+    assert(out);
+
+    *out = (struct slab_stats){0};
+    server_worker_pool_merge_alloc_stats(server->pool, out);
+}
+
 void server_destroy(struct server *server) {
     assert(server);
 
@@ -235,8 +325,8 @@ void server_destroy(struct server *server) {
 
         do {
             struct plot_socket *next = listc_get_next(iter, plot_socket_ring);
-            close(iter->sockfd);
-            free(iter);
+            for ( unsigned i = 0; i < iter->sockfds_nr; i++ ) close(iter->sockfds[i]);
+            plot_socket_destroy(iter);
             iter = next;
         } while ( iter != server->plot_sockets );
     }
@@ -1,10 +1,59 @@
 #pragma once
 
 #include "plot.h"
+#include "slab.h"
+
+typedef unsigned server_flags_t;
+
+// Open one SO_REUSEPORT socket per worker for every plot instead of accepting in the main thread
+#define SERVER_REUSEPORT ((server_flags_t)0x00000001)
+
+#define SERVER_ACCEPT_BATCH_DEFAULT 64u
+#define SERVER_EVENTS_BATCH_DEFAULT 64u
+
+// How the main thread chooses a worker for a new client. With SERVER_REUSEPORT the kernel does it instead
+enum server_balance_policy {
+    SERVER_BALANCE_LEAST_CLIENTS,   // The worker with the fewest clients
+    SERVER_BALANCE_ROUND_ROBIN,
+    SERVER_BALANCE_TWO_CHOICES,     // The less loaded of two random workers
+    SERVER_BALANCE_COST,            // The cheapest worker by clients, queued send bytes and pending timers
+    SERVER_BALANCE_POLICIES_NR
+};
+
+// Event loop of the workers. If the kernel can't do io_uring, workers fall back to epoll
+enum server_backend {
+    SERVER_BACKEND_EPOLL,
+    SERVER_BACKEND_URING,   // Multishot accept and recv, provided buffers, sends linked with task timeouts
+    SERVER_BACKENDS_NR
+};
+
+struct server_config {
+    unsigned workers_nr;
+    server_flags_t flags;
+    unsigned accept_batch;   // Max connections accepted from one listener per wakeup, 0 means default
+    unsigned events_batch;   // Max epoll events a worker handles per wakeup, 0 means default
+    enum server_balance_policy balance;
+    enum server_backend backend;
+    size_t zerocopy_min;     // Send runs this long go with MSG_ZEROCOPY (epoll backend only), 0 turns it off
+};
+
+struct server_accept_stats {
+    unsigned long wakeups;     // Acceptor wakeups with at least one ready listener
+    unsigned long accepted;    // Accepted connections
+    unsigned long max_batch;   // Max accepted connections per wakeup
+};
+
+extern int server_balance_policy_from_name(const char *name, enum server_balance_policy *out);
+extern const char *server_balance_policy_name(enum server_balance_policy policy);
+extern int server_backend_from_name(const char *name, enum server_backend *out);
+extern const char *server_backend_name(enum server_backend backend);
 
 struct server;
 
-extern struct server *server_create(unsigned wq_workers_nr);
+extern struct server *server_create(const struct server_config *config);
 extern int server_add_plot(struct server *server, plot_constructor_t pc, unsigned short port);
 extern int server_remove_plot(struct server *server, unsigned short port);
+extern void server_get_accept_stats(struct server *server, struct server_accept_stats *out);
+// Client structs of all workers, slabs only grow until the peak of concurrent clients
+extern void server_get_alloc_stats(struct server *server, struct slab_stats *out);
 extern void server_destroy(struct server *server);
@@ -0,0 +1,56 @@
+#define _GNU_SOURCE
+#include "server_accept.h"
+#include <assert.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "log.h"
+
+unsigned server_accept_batch(int sockfd, unsigned batch, server_accept_handler_t handler, void *arg) {
+    assert(sockfd > -1);
+    assert(batch > 0);
+    assert(handler);
+
+    unsigned accepted = 0;
+
+    while ( accepted < batch ) {
+        int clientfd = accept4(sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if ( clientfd == -1 ) {
+            if ( errno == EINTR || errno == ECONNABORTED ) continue;
+            if ( errno != EAGAIN && errno != EWOULDBLOCK ) log_msg(LOG_WARN, "Failed to accept connection\n");
+            break;   // The backlog is drained (or broken), wait for the next wakeup
+        }
+
+        if ( handler(arg, clientfd) ) {
+            log_msg(LOG_WARN, "Failed to bind client\n");
+            close(clientfd);
+            continue;
+        }
+
+        accepted++;
+    }
+
+    return accepted;
+}
+
+void server_accept_stats_account(struct server_accept_stats *stats, unsigned accepted) {
+    assert(stats);
+
+    __atomic_add_fetch(&stats->wakeups, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->accepted, accepted, __ATOMIC_RELAXED);
+
+    // Only the owner of stats writes max_batch, so we don't need CAS here
+    if ( __atomic_load_n(&stats->max_batch, __ATOMIC_RELAXED) < accepted )
+        __atomic_store_n(&stats->max_batch, accepted, __ATOMIC_RELAXED);
+}
+
+void server_accept_stats_merge(struct server_accept_stats *dest, const struct server_accept_stats *src) {
+    assert(dest);
+    assert(src);
+
+    dest->wakeups += __atomic_load_n(&src->wakeups, __ATOMIC_RELAXED);
+    dest->accepted += __atomic_load_n(&src->accepted, __ATOMIC_RELAXED);
+
+    unsigned long max_batch = __atomic_load_n(&src->max_batch, __ATOMIC_RELAXED);
+    if ( dest->max_batch < max_batch ) dest->max_batch = max_batch;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "server.h"
+
+typedef int (*server_accept_handler_t)(void *arg, int clientfd);
+
+/*
+ * Accepts up to batch connections from the nonblocking sockfd until it runs dry.
+ * Accepted sockets are already nonblocking and close-on-exec.
+ * Handler takes the ownership of clientfd on success, otherwise clientfd is closed here.
+ * Returns the number of connections passed to the handler.
+ */
+unsigned server_accept_batch(int sockfd, unsigned batch, server_accept_handler_t handler, void *arg);
+
+// Stats can be read by any thread while the acceptor updates them
+void server_accept_stats_account(struct server_accept_stats *stats, unsigned accepted);
+void server_accept_stats_merge(struct server_accept_stats *dest, const struct server_accept_stats *src);
@@ -0,0 +1,104 @@
+#include "server_timer_wheel.h"
+#include <assert.h>
+#include <stdlib.h>
+
+int server_timer_wheel_init(struct server_timer_wheel *tw, unsigned slots_nr) {
+    assert(tw);
+    assert(slots_nr > 0 && (slots_nr & (slots_nr - 1)) == 0);
+
+    tw->slots = calloc(slots_nr, sizeof(struct server_timer *));
+    if ( tw->slots == NULL ) return -1;
+
+    tw->slots_nr = slots_nr;
+    tw->now = 0;
+    tw->armed_nr = 0;
+    tw->fired = NULL;
+    return 0;
+}
+
+void server_timer_wheel_fini(struct server_timer_wheel *tw) {
+    assert(tw);
+    assert(tw->armed_nr == 0);   // Timers live in their owners, they must be cancelled by now
+    free(tw->slots);
+}
+
+void server_timer_init(struct server_timer *timer) {
+    assert(timer);
+    listc_init(timer, ring);
+    timer->list = NULL;
+    timer->expires = 0;
+}
+
+bool server_timer_armed(const struct server_timer *timer) {
+    assert(timer);
+    return timer->list != NULL;
+}
+
+void server_timer_arm(struct server_timer_wheel *tw, struct server_timer *timer, unsigned long ticks) {
+    assert(tw);
+    assert(timer);
+
+    server_timer_cancel(tw, timer);
+
+    // The current tick is partly gone, so one more tick keeps the whole timeout
+    timer->expires = tw->now + ticks + 1;
+    timer->list = &tw->slots[timer->expires & (tw->slots_nr - 1)];
+    listc_add_item_back(timer->list, timer, ring);
+    tw->armed_nr++;
+}
+
+void server_timer_cancel(struct server_timer_wheel *tw, struct server_timer *timer) {
+    assert(tw);
+    assert(timer);
+
+    if ( timer->list == NULL ) return;
+
+    listc_remove_item(timer->list, timer, ring);
+    timer->list = NULL;
+    tw->armed_nr--;
+}
+
+static void server_timer_wheel_tick(struct server_timer_wheel *tw, server_timer_expire_t expire, void *arg) {
+    tw->now++;
+
+    struct server_timer **slot = &tw->slots[tw->now & (tw->slots_nr - 1)];
+    if ( *slot == NULL ) return;
+
+    // Move expired timers aside first, so expire can't touch the slot we are walking
+    struct server_timer *iter = *slot;
+    struct server_timer *end = listc_get_prev(iter, ring);
+    bool last;
+    do {
+        struct server_timer *next = listc_get_next(iter, ring);
+        last = iter == end;
+
+        if ( iter->expires <= tw->now ) {
+            listc_remove_item(slot, iter, ring);
+            iter->list = &tw->fired;
+            listc_add_item_back(&tw->fired, iter, ring);
+        }
+
+        iter = next;
+    } while ( !last );
+
+    // Expire can cancel other fired timers, they just leave the list
+    while ( tw->fired != NULL ) {
+        struct server_timer *timer = tw->fired;
+        server_timer_cancel(tw, timer);
+        expire(timer, arg);
+    }
+}
+
+void server_timer_wheel_advance(
+    struct server_timer_wheel *tw, unsigned long ticks, server_timer_expire_t expire, void *arg
+) {
+    assert(tw);
+    assert(expire);
+
+    while ( ticks > 0 && tw->armed_nr > 0 ) {
+        server_timer_wheel_tick(tw, expire, arg);
+        ticks--;
+    }
+
+    tw->now += ticks;   // Nothing is armed, so the rest of the slots are empty
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include "listc.h"
+
+// Intrusive timer, embed it into the object it times out
+struct server_timer {
+    struct listc ring;
+    struct server_timer **list;   // The list the timer is in, NULL if it isn't armed
+    unsigned long expires;        // In ticks of the wheel
+};
+
+/*
+ * Hashed timing wheel. Arming and cancelling are O(1), a tick costs one slot scan.
+ * Timers further than one revolution away just stay in their slot until their tick comes.
+ * Not thread safe, the owner drives it with server_timer_wheel_advance().
+ */
+struct server_timer_wheel {
+    struct server_timer **slots;
+    unsigned slots_nr;   // Power of two
+    unsigned long now;
+    unsigned armed_nr;
+    struct server_timer *fired;   // Expired on the current tick, but not handled yet
+};
+
+typedef void (*server_timer_expire_t)(struct server_timer *timer, void *arg);
+
+int server_timer_wheel_init(struct server_timer_wheel *tw, unsigned slots_nr);
+void server_timer_wheel_fini(struct server_timer_wheel *tw);
+
+void server_timer_init(struct server_timer *timer);
+bool server_timer_armed(const struct server_timer *timer);
+// The timer expires after ticks full ticks at least, an armed timer is rearmed
+void server_timer_arm(struct server_timer_wheel *tw, struct server_timer *timer, unsigned long ticks);
+void server_timer_cancel(struct server_timer_wheel *tw, struct server_timer *timer);
+
+/*
+ * Moves the wheel ticks ticks forward and calls expire for every expired timer.
+ * The timer is disarmed before the call, expire can rearm or cancel any timer.
+ */
+void server_timer_wheel_advance(
+    struct server_timer_wheel *tw, unsigned long ticks, server_timer_expire_t expire, void *arg
+);
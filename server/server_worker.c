@@ -1,4 +1,5 @@
-#include "server_worker.h"
+#define _GNU_SOURCE
+#include "server_worker_priv.h"
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
@@ -6,227 +7,221 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/epoll.h>
-#include <sys/fcntl.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
 #include <sys/timerfd.h>
 #include <unistd.h>
 #include "bstream.h"
 #include "listc.h"
 #include "log.h"
+#include "rcmem.h"
+#include "server_accept.h"
 
-struct client {
-    int sockfd;
-    struct listc client_ring;
-    struct client_timer *timers;
-    struct server_worker_event *event;
-
-    struct plot *plot;
-    struct plot_task *current_task;
-    struct question *current_question;
-    struct bstream *send_stream;
+static const struct server_worker_backend *const backends[SERVER_BACKENDS_NR] = {
+    [SERVER_BACKEND_EPOLL] = &server_worker_epoll_backend,
+    [SERVER_BACKEND_URING] = &server_worker_uring_backend
 };
 
-struct client_timer {
-    int timerfd;
-    struct client *client;
-    struct listc timers_ring;
-    struct server_worker_event *event;
-};
+int server_backend_from_name(const char *name, enum server_backend *out) {
+    assert(name);
+    assert(out);
 
-struct server_worker {
-    int epfd;
-    pthread_t thread;
-    struct client *clients;
-    unsigned clients_nr;
-    pthread_mutex_t clients_mtx;
-};
+    for ( unsigned i = 0; i < SERVER_BACKENDS_NR; i++ ) {
+        if ( !strcmp(backends[i]->name, name) ) {
+            *out = i;
+            return 0;
+        }
+    }
 
-enum server_worker_event_type {
-    SWET_TIMER,
-    SWET_CLIENT
-};
+    return -1;
+}
 
-struct server_worker_event {
-    union {
-        struct client_timer *timer;
-        struct client *client;
-    } data;
-    enum server_worker_event_type type;
-};
+const char *server_backend_name(enum server_backend backend) {
+    assert(backend < SERVER_BACKENDS_NR);
+    return backends[backend]->name;
+}
 
-static enum answer_state plot_task_check_fd(struct plot_task *pt, int fd) {
-    assert(fd > -1);
-    assert(pt);
-    int new_fd = dup(fd);
-    if ( new_fd == -1 ) return ANSWER_WRONG;
-
-    FILE *fp = fdopen(new_fd, "r");
-    if ( fp == NULL ) {
-        int e = errno;
-        close(new_fd);
-        errno = e;
-        return ANSWER_WRONG;
-    }
+bool worker_stopping(struct server_worker *worker) {
+    return __atomic_load_n(&worker->stopping, __ATOMIC_ACQUIRE);
+}
 
-    enum answer_state res = plot_task_check(pt, fp);
-    fclose(fp);   // new_fd is also closed by this call
-    return res;
+// Handoffs, listener changes and stop requests share the eventfd
+void worker_wakeup(struct server_worker *worker) {
+    uint64_t one = 1;
+    write(worker->handoff_efd, &one, sizeof(one));
 }
 
-static void client_timer_destroy(struct server_worker *worker, struct client_timer *timer) {
-    assert(timer);
+// Only the worker thread changes its load, other threads read it for balancing
+void worker_add_send_bytes(struct server_worker *worker, size_t bytes) {
+    __atomic_add_fetch(&worker->send_bytes, bytes, __ATOMIC_RELAXED);
+}
 
-    epoll_ctl(worker->epfd, EPOLL_CTL_DEL, timer->timerfd, NULL);
-    close(timer->timerfd);
-    listc_remove_item(&timer->client->timers, timer, timers_ring);
-    free(timer->event);
-    free(timer);
+void worker_sub_send_bytes(struct server_worker *worker, size_t bytes) {
+    __atomic_sub_fetch(&worker->send_bytes, bytes, __ATOMIC_RELAXED);
 }
 
-static int client_timer_setup(struct server_worker *worker, struct client *client, unsigned long msec_timeout) {
-    assert(msec_timeout > 0);
+// Task deadlines are rounded up to whole ticks
+#define WORKER_TIMER_TICK_MSEC 10u
+#define WORKER_TIMER_SLOTS 1024u   // About 10 seconds per revolution
 
-    struct client_timer *timer = malloc(sizeof(struct client_timer));
-    if ( timer == NULL ) return -1;
+#define WORKER_CLIENTS_PER_SLAB 64u
+#define WORKER_HANDOFF_SLOTS 1024u   // Connections accepted but not yet taken, more are refused
 
-    struct server_worker_event *event = malloc(sizeof(struct server_worker_event));
-    if ( event == NULL ) goto free_timer;
+// The timerfd ticks only while something is armed, so an idle worker sleeps
+static void worker_timerfd_set(struct server_worker *worker, bool on) {
+    if ( worker->timerfd_armed == on ) return;
 
-    event->data.timer = timer;
-    event->type = SWET_TIMER;
-    timer->event = event;
+    struct itimerspec its = {0};
+    if ( on ) {
+        its.it_interval.tv_nsec = WORKER_TIMER_TICK_MSEC * 1000000;
+        its.it_value = its.it_interval;
+    }
 
-    timer->timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
-    if ( timer->timerfd == -1 ) goto free_event;
+    if ( timerfd_settime(worker->timerfd, 0, &its, NULL) == 0 ) worker->timerfd_armed = on;
+}
 
-    timer->client = client;
+static void worker_timers_changed(struct server_worker *worker) {
+    __atomic_store_n(&worker->timers_nr, worker->timers.armed_nr, __ATOMIC_RELAXED);
+}
 
-    struct epoll_event ev = {.data.ptr = timer->event, .events = EPOLLONESHOT | EPOLLIN};
+static void client_deadline_arm(struct server_worker *worker, struct client *client, unsigned long msec_timeout) {
+    assert(msec_timeout > 0);
 
-    if ( epoll_ctl(worker->epfd, EPOLL_CTL_ADD, timer->timerfd, &ev) ) goto close_timerfd;
+    unsigned long ticks = msec_timeout / WORKER_TIMER_TICK_MSEC + (msec_timeout % WORKER_TIMER_TICK_MSEC != 0);
+    server_timer_arm(&worker->timers, &client->deadline, ticks);
+    worker_timers_changed(worker);
+    worker_timerfd_set(worker, true);
+}
 
-    listc_init(timer, timers_ring);
-    listc_add_item_back(&client->timers, timer, timers_ring);
+// The timerfd is stopped on its next tick, if nothing is armed anymore
+static void client_deadline_cancel(struct server_worker *worker, struct client *client) {
+    if ( !server_timer_armed(&client->deadline) ) return;
 
-    time_t secs = msec_timeout / 1000;
-    unsigned long nsecs = (msec_timeout % 1000) * 1000000;
+    server_timer_cancel(&worker->timers, &client->deadline);
+    worker_timers_changed(worker);
+}
 
-    struct itimerspec its = {
-        .it_interval = {.tv_nsec = 0,   .tv_sec = 0     },
-        .it_value = {.tv_sec = secs, .tv_nsec = nsecs}
-    };
+static void client_deadline_expired(struct server_timer *timer, void *arg) {
+    struct server_worker *worker = arg;
+    struct client *client = containerof(struct client, timer, deadline);
 
-    timerfd_settime(timer->timerfd, 0, &its, NULL);
+    log_msg(LOG_DEBUG, "Client %p was disconnected because of the timeout\n", client);
+    client_disconnect(worker, client);
+}
 
-    return 0;
+void worker_expire_timers(struct server_worker *worker) {
+    uint64_t ticks;
+    if ( read(worker->timerfd, &ticks, sizeof(ticks)) != sizeof(ticks) ) return;   // It's nonblocking
 
-close_timerfd:
-    close(timer->timerfd);
-free_event:
-    free(event);
-free_timer:
-    free(timer);
-    return -1;
+    server_timer_wheel_advance(&worker->timers, ticks, client_deadline_expired, worker);
+    worker_timers_changed(worker);
+    if ( worker->timers.armed_nr == 0 ) worker_timerfd_set(worker, false);
 }
 
 static struct client *client_create(struct server_worker *wr, int clientfd, plot_constructor_t pc) {
-    struct client *cl = malloc(sizeof(struct client));
+    struct client *cl = slab_alloc(&wr->clients_cache);
     if ( cl == NULL ) return NULL;
 
     cl->plot = pc();
     if ( cl->plot == NULL ) goto free_cl;
 
-    cl->send_stream = bstream_create();
-    if ( cl->send_stream == NULL ) goto destroy_plot;
+    bstream_init(&cl->send_stream);
 
-    int old_fl = fcntl(clientfd, F_GETFL);
-    fcntl(clientfd, F_SETFL, O_NONBLOCK);   // this action doesn't raise error
-    cl->sockfd = clientfd;
+    cl->sockfd = clientfd;   // Acceptors give us nonblocking sockets
 
     listc_init(cl, client_ring);
     cl->current_question = NULL;
     cl->current_task = NULL;
-    cl->event = NULL;
-    cl->timers = NULL;
-
-    
-    // Event creation
-    struct server_worker_event *event = malloc(sizeof(struct server_worker_event));
-    if ( event == NULL ) goto destroy_cl;
-
-    cl->event = event;
-    event->data.client = cl;
-    event->type = SWET_CLIENT;
-
-    struct epoll_event ev = {.events = EPOLLRDHUP, .data.ptr = event};
-
-    pthread_mutex_lock(&wr->clients_mtx);
-
-    if ( epoll_ctl(wr->epfd, EPOLL_CTL_ADD, cl->sockfd, &ev) ) {
-        pthread_mutex_unlock(&wr->clients_mtx);
-        goto free_event;
-    }
+    cl->event.data.client = cl;
+    cl->event.type = SWET_CLIENT;
+    cl->recv_buf = NULL;
+    cl->recv_len = 0;
+    cl->recv_size = 0;
+    server_timer_init(&cl->deadline);
+    cl->released = false;
+    cl->inflight = 0;
+    cl->sending = false;
+
+    if ( wr->backend->client_watch(wr, cl) ) goto destroy_plot;
     listc_add_item_back(&wr->clients, cl, client_ring);
-    wr->clients_nr++;
-
-    pthread_mutex_unlock(&wr->clients_mtx);
 
     log_msg(LOG_DEBUG, "Client %p was created on worker %p\n", cl, wr);
     return cl;
 
-free_event:
-    free(event);
-destroy_cl:
-    bstream_destroy(cl->send_stream);
-    fcntl(clientfd, F_SETFL, old_fl);
 destroy_plot:
     plot_destroy(cl->plot);
 free_cl:
-    free(cl);
+    slab_free(&wr->clients_cache, cl);
     return NULL;
 }
 
-static void client_disconnect(struct server_worker *wr, struct client *cl) {
-    pthread_mutex_lock(&wr->clients_mtx);
-    epoll_ctl(wr->epfd, EPOLL_CTL_DEL, cl->sockfd, NULL);
+void client_free(struct server_worker *worker, struct client *client) {
+    bstream_fini(&client->send_stream);   // Only now, zerocopy sends may read it until the socket is closed
+    slab_free(&worker->clients_cache, client);
+}
+
+static void client_recv_buf_free(struct server_worker *worker, struct client *client) {
+    if ( client->recv_size == CLIENT_RECV_BUF_MIN ) {
+        slab_free(&worker->recv_cache, client->recv_buf);
+    } else {
+        free(client->recv_buf);   // Only long answers get here
+    }
+
+    client->recv_buf = NULL;
+    client->recv_len = 0;
+    client->recv_size = 0;
+}
+
+void client_disconnect(struct server_worker *wr, struct client *cl) {
     listc_remove_item(&wr->clients, cl, client_ring);
-    wr->clients_nr--;
-    pthread_mutex_unlock(&wr->clients_mtx);
+    __atomic_sub_fetch(&wr->clients_nr, 1, __ATOMIC_RELAXED);
 
-    close(cl->sockfd);
-    free(cl->event);
     plot_destroy(cl->plot);
-    bstream_destroy(cl->send_stream);
+    worker_sub_send_bytes(wr, bstream_len(&cl->send_stream));
     if ( cl->current_question ) question_destroy(cl->current_question);
     if ( cl->current_task ) plot_task_destroy(cl->current_task);
+    client_recv_buf_free(wr, cl);
 
-    while ( cl->timers ) client_timer_destroy(wr, cl->timers);
+    client_deadline_cancel(wr, cl);
 
     log_msg(LOG_DEBUG, "Client %p was destroyed\n", cl);
-    free(cl);
+    wr->backend->client_release(wr, cl);   // It closes the socket
 }
 
-static void client_send_task_text(struct client *client, const char *text, unsigned long timeout) {
-    struct bstream *bst = client->send_stream;
+// Returns true if the stream doesn't need the question anymore
+static bool client_send_task_text(struct client *client, const struct question *q, unsigned long timeout) {
+    struct bstream *bst = &client->send_stream;
+    const char *text = question_get_text(q);
+    bool rc = question_text_is_rc(q);
+
+    if ( rc ) bstream_write_rcmem(bst, (char *)text, strlen(text));   // The stream holds the text by itself
+    else bstream_write_borrow(bst, text, strlen(text));
 
     if ( timeout != 0 ) {
         char buf[256];
         snprintf(buf, sizeof(buf), "\nAnswer (timeout %lu msec): ", timeout);
 
-        bstream_write_borrow(bst, text, strlen(text));
         bstream_write_mem(bst, buf, strlen(buf)); //We can't borrow from stack
     } else {
-        bstream_write_borrow(bst, text, strlen(text));
         const char extra_text[] = "\nAnswer (no timeout): ";
         bstream_write_borrow(bst, extra_text, sizeof(extra_text));
     }
+
+    return rc;
 }
 
 static int client_next_task(struct server_worker *worker, struct client *client) {
     assert(worker);
     assert(client);
 
-    bstream_flush(client->send_stream);
+    worker_sub_send_bytes(worker, bstream_len(&client->send_stream));
+    bstream_flush(&client->send_stream);
+    client_deadline_cancel(worker, client);   // The previous task is done
+
+    if ( client->current_question != NULL ) {   // The answer came before the whole question was sent
+        question_destroy(client->current_question);
+        client->current_question = NULL;
+    }
 
     if ( client->current_task != NULL )   // Possibly we haven't given any task for this client
         plot_task_destroy(client->current_task);
@@ -242,168 +237,271 @@ static int client_next_task(struct server_worker *worker, struct client *client)
     struct question *q = plot_task_get_question(new_task);
     if ( q == NULL ) goto destroy_plot_task;
 
-    struct epoll_event ev = {
-        .data.ptr = client->event,
-        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP
-    };   // Poll for EPOLLOUT now
-
-    // Notice that we only modify epoll entry, it must be added before this
-    if ( epoll_ctl(worker->epfd, EPOLL_CTL_MOD, client->sockfd, &ev) ) goto destroy_question;
-
     client->current_task = new_task;
-    client->current_question = q;
-    const char *text = question_get_text(q);
+    if ( client_send_task_text(client, q, plot_task_get_timeout_msec(new_task)) )
+        question_destroy(q);   // Cached texts are shared with other clients, no need to keep them until sent
+    else
+        client->current_question = q;
+    worker_add_send_bytes(worker, bstream_len(&client->send_stream));
 
-    client_send_task_text(client, text, plot_task_get_timeout_msec(new_task));
-
-    return 0;
+    // The task belongs to the client now, the caller disconnects it on failure
+    return worker->backend->client_send(worker, client);
 
-destroy_question:
-    question_destroy(q);
 destroy_plot_task:
     plot_task_destroy(new_task);
     return -1;
 }
 
-static int client_send_text(struct server_worker *worker, struct client *client) {
-    assert(worker);
-    assert(client);
+void client_question_sent(struct server_worker *worker, struct client *client) {
+    if ( client->current_question != NULL ) {
+        question_destroy(client->current_question); //We can destroy question, because now bst doesn't borrow anything
+        client->current_question = NULL;
+    }
 
-    if ( client->current_question == NULL ) return 0;   // No questions for client now
+    assert(client->current_task);
+    unsigned long timeout = plot_task_get_timeout_msec(client->current_task);
+    if ( timeout != 0 ) client_deadline_arm(worker, client, timeout);
+}
+
+int client_handle_answer(struct server_worker *worker, struct client *client, enum answer_state res) {
+    if ( res == ANSWER_WRONG ) {
+        log_msg(LOG_DEBUG, "Client %p was disconnected because of wrong answer\n", client);
+        client_disconnect(worker, client);
+        return -1;
+    } else if ( res == ANSWER_RIGHT ) {
+        if ( client_next_task(worker, client) ) {
+            client_disconnect(worker, client);
+            return -1;
+        }
+    } else {
+        assert(res == ANSWER_MORE);
+    }
 
-    struct bstream *bst = client->send_stream;
+    return 0;
+}
 
-    ssize_t written = bstream_read_fd(bst, client->sockfd, bstream_len(bst));
-    if ( written == 0 ) log_msg(LOG_WARN, "Failed to send data to clientfd %d\n", client->sockfd);
+char *client_recv_space(struct server_worker *worker, struct client *client, size_t *space) {
+    if ( client->recv_len == client->recv_size ) {
+        if ( client->recv_size >= CLIENT_RECV_BUF_MAX ) return NULL;
+
+        char *buf;
+        size_t size;
+        if ( client->recv_size == 0 ) {
+            size = CLIENT_RECV_BUF_MIN;
+            buf = slab_alloc(&worker->recv_cache);
+        } else if ( client->recv_size == CLIENT_RECV_BUF_MIN ) {
+            size = client->recv_size * 2;
+            buf = malloc(size);
+            if ( buf != NULL ) {
+                memcpy(buf, client->recv_buf, client->recv_len);
+                slab_free(&worker->recv_cache, client->recv_buf);
+            }
+        } else {
+            size = client->recv_size * 2;
+            buf = realloc(client->recv_buf, size);
+        }
+        if ( buf == NULL ) return NULL;
 
-    if ( bstream_len(bst) == 0 ) {
-        // bstream_flush(client->send_stream);   // We don't want to flush the buffer because it alredy has zero len
-        question_destroy(client->current_question); //We can destroy question, because now bst doesn't borrow anything
-        client->current_question = NULL;
+        client->recv_buf = buf;
+        client->recv_size = size;
+    }
 
-        struct epoll_event ev = {.data.ptr = client->event, .events = EPOLLIN | EPOLLRDHUP};
+    *space = client->recv_size - client->recv_len;
+    return client->recv_buf + client->recv_len;
+}
 
-        if ( epoll_ctl(worker->epfd, EPOLL_CTL_MOD, client->sockfd, &ev) )   // We aren't interested in writting now
-            return -1;
+int client_handle_received(struct server_worker *worker, struct client *client) {
+    // Answers can come back to back, each one goes to the task that is current by then
+    while ( client->recv_len > 0 && client->current_task != NULL ) {
+        size_t consumed;
+        enum answer_state res = plot_task_check_mem(client->current_task, client->recv_buf, client->recv_len, &consumed);
+        assert(consumed <= client->recv_len);
 
+        client->recv_len -= consumed;
+        memmove(client->recv_buf, client->recv_buf + consumed, client->recv_len);
 
-        assert(client->current_task);
-        unsigned long timeout = plot_task_get_timeout_msec(client->current_task);
-        if ( timeout != 0 ) client_timer_setup(worker, client, timeout);
+        if ( res == ANSWER_MORE ) break;
+        if ( client_handle_answer(worker, client, res) ) return -1;
     }
 
     return 0;
 }
 
-[[noreturn]]
-static void *worker_handler(void *arg) {
-    signal(SIGPIPE, SIG_IGN);   // Block SIGPIPE, otherwise, writting to closed socket will crash program
-    struct server_worker *w = arg;
-
-    struct epoll_event ev;
+static void worker_listener_destroy(struct worker_listener *listener) {
+    free(listener->event);
+    free(listener);
+}
 
-    while ( true ) {
-        int res;
-        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-
-        /*
-         * ATTENTION!!!
-         * epoll_wait doesn't have to be a cancellation point. It is now, but it could change in the future
-         * ATTENTION!!!
-         */
-retry:
-        res = epoll_wait(w->epfd, &ev, 1, -1);
-        if ( res == -1 ) {
-            if ( errno == EINTR ) goto retry;
-        }
-        assert(res != -1);
+// Listeners the backend still holds stay in the inactive list
+void worker_cleanup_inactive_listeners(struct server_worker *worker) {
+    struct worker_listener *held = NULL;
 
-        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    while ( worker->inactive_listeners != NULL ) {
+        struct worker_listener *listener = worker->inactive_listeners;
+        assert(!listener->active);
+        listc_remove_item(&worker->inactive_listeners, listener, listeners_ring);
 
+        if ( listener->armed ) {
+            listc_add_item_back(&held, listener, listeners_ring);
+        } else {
+            worker_listener_destroy(listener);
+        }
+    }
 
-        struct server_worker_event *event = ev.data.ptr;
+    worker->inactive_listeners = held;
+}
 
-        if ( event->type == SWET_TIMER ) {
-            struct client_timer *timer = event->data.timer;
-            struct client *client = timer->client;
+/*
+ * Must be called only by the worker thread.
+ * Returns -1 if the client wasn't created (clientfd is still yours), 1 if the client was created,
+ * but has already been disconnected, 0 on success
+ */
+static int worker_client_add(struct server_worker *worker, int clientfd, plot_constructor_t pc) {
+    struct client *client = client_create(worker, clientfd, pc);
+    if ( client == NULL ) return -1;
 
-            client_timer_destroy(w, timer);
+    if ( client_next_task(worker, client) ) {
+        client_disconnect(worker, client);   // It also closes clientfd
+        return 1;
+    }
 
-            assert(client->current_task);
-            if ( plot_task_check_fd(client->current_task, client->sockfd) != ANSWER_RIGHT ) {
-                log_msg(LOG_DEBUG, "Client %p was disconnected because of the timeout\n", client);
-                client_disconnect(w, client);
-            } else {
-                if ( client_next_task(w, client) ) {
-                    client_disconnect(w, client);
-                    continue;
-                }
-            }
-        } else if ( event->type == SWET_CLIENT ) {
-            struct client *client = event->data.client;
-
-            if ( ev.events & EPOLLIN ) {
-                if ( client->current_task != NULL ) {
-                    enum answer_state res = plot_task_check_fd(client->current_task, client->sockfd);
-
-                    if ( res == ANSWER_WRONG ) {
-                        log_msg(LOG_DEBUG, "Client %p was disconnected because of wrong answer\n", client);
-                        client_disconnect(w, client);
-                        continue;
-                    } else if ( res == ANSWER_MORE ) {
-                        continue;
-                    } else if ( res == ANSWER_RIGHT ) {
-                        if ( client_next_task(w, client) ) {
-                            client_disconnect(w, client);
-                            continue;
-                        }
-                    } else {
-                        assert(0);
-                    }
-                }
-            }
+    return 0;
+}
 
-            if ( ev.events & EPOLLOUT ) {
-                if ( client_send_text(w, client) ) {
-                    log_msg(LOG_DEBUG, "Client %p was disconnected because of sending problem\n", client);
-                    client_disconnect(w, client);
-                    continue;
-                }
-            }
+// The backend has already reset handoff_efd
+void worker_take_handoffs(struct server_worker *worker) {
+    // Producers that fill slots after this see the flag clear and wake us up again
+    (void)__atomic_exchange_n(&worker->handoff_pending, false, __ATOMIC_ACQ_REL);
 
-            if ( ev.events & EPOLLRDHUP ) {
-                log_msg(LOG_DEBUG, "Client %p disconnected\n", client);
-                client_disconnect(w, client);
-                continue;
-            }
-        } else {
-            assert(0);
+    while ( true ) {
+        size_t pos = worker->handoff_head;
+        struct client_handoff *ho = &worker->handoff_ring[pos % WORKER_HANDOFF_SLOTS];
+        if ( __atomic_load_n(&ho->seq, __ATOMIC_ACQUIRE) != pos + 1 ) break;   // Empty or not filled yet
+
+        int clientfd = ho->clientfd;
+        plot_constructor_t pc = ho->pc;
+        __atomic_store_n(&ho->seq, pos + WORKER_HANDOFF_SLOTS, __ATOMIC_RELEASE);   // Free for the next lap
+        worker->handoff_head = pos + 1;
+
+        if ( worker_client_add(worker, clientfd, pc) == -1 ) {
+            // The client wasn't created, so the socket is still ours
+            log_msg(LOG_WARN, "Failed to bind client\n");
+            close(clientfd);
+            __atomic_sub_fetch(&worker->clients_nr, 1, __ATOMIC_RELAXED);
         }
     }
 }
 
-struct server_worker *server_worker_create() {
+// For connections accepted by the worker itself. Returns -1 if clientfd is still yours
+int worker_accept_client(struct server_worker *worker, int clientfd, plot_constructor_t pc) {
+    __atomic_add_fetch(&worker->clients_nr, 1, __ATOMIC_RELAXED);
+    if ( worker_client_add(worker, clientfd, pc) == -1 ) {
+        __atomic_sub_fetch(&worker->clients_nr, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    log_msg(LOG_INFO, "New connection on worker %p\n", worker);
+    return 0;
+}
+
+static void *worker_thread(void *arg) {
+    signal(SIGPIPE, SIG_IGN);   // Block SIGPIPE, otherwise, writting to closed socket will crash program
+    struct server_worker *worker = arg;
+
+    worker->backend->loop(worker);
+
+    bstream_pool_trim(0);   // Clients are finished by server_worker_destroy, their buffers go to that thread
+    rcmem_pool_flush();
+    return NULL;
+}
+
+struct server_worker *server_worker_create(const struct server_config *config) {
+    assert(config);
+    assert(config->accept_batch > 0);
+    assert(config->events_batch > 0);
+    assert(config->backend < SERVER_BACKENDS_NR);
+
     struct server_worker *worker = malloc(sizeof(struct server_worker));
     if ( worker == NULL ) return NULL;
 
+    worker->backend = backends[config->backend];
+    worker->backend_data = NULL;
+    worker->stopping = false;
+    worker->accept_batch = config->accept_batch;
+    worker->events_batch = config->events_batch;
+    worker->zerocopy_min = config->zerocopy_min;
+    worker->accept_stats = (struct server_accept_stats){0};
     worker->clients_nr = 0;
+    worker->send_bytes = 0;
+    worker->timers_nr = 0;
+    slab_cache_init(&worker->clients_cache, sizeof(struct client), WORKER_CLIENTS_PER_SLAB);
+    slab_cache_init(&worker->recv_cache, CLIENT_RECV_BUF_MIN, WORKER_CLIENTS_PER_SLAB);
 
     worker->clients = NULL;
+    worker->listeners = NULL;
+    worker->inactive_listeners = NULL;
+
+    worker->handoff_ring = malloc(WORKER_HANDOFF_SLOTS * sizeof(struct client_handoff));
+    if ( worker->handoff_ring == NULL ) goto free_worker;
+
+    for ( unsigned i = 0; i < WORKER_HANDOFF_SLOTS; i++ ) worker->handoff_ring[i].seq = i;
+    worker->handoff_tail = 0;
+    worker->handoff_head = 0;
+    worker->handoff_pending = false;
+
+    worker->handoff_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ( worker->handoff_efd == -1 ) goto free_handoff_ring;
+
+    worker->handoff_event = malloc(sizeof(struct server_worker_event));
+    if ( worker->handoff_event == NULL ) goto close_handoff_efd;
+
+    worker->handoff_event->type = SWET_HANDOFF;
+    worker->handoff_event->data.client = NULL;
+
+    if ( server_timer_wheel_init(&worker->timers, WORKER_TIMER_SLOTS) ) goto free_handoff_event;
+
+    worker->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if ( worker->timerfd == -1 ) goto fini_timers;
+    worker->timerfd_armed = false;
+
+    worker->timer_event = malloc(sizeof(struct server_worker_event));
+    if ( worker->timer_event == NULL ) goto close_timerfd;
+
+    worker->timer_event->type = SWET_TIMER;
+    worker->timer_event->data.client = NULL;
+
+    if ( worker->backend->init(worker) ) {
+        if ( worker->backend == &server_worker_epoll_backend ) goto free_timer_event;
 
-    worker->epfd = epoll_create1(0);
-    if ( worker->epfd == -1 ) goto free_worker;
+        log_msg(LOG_WARN, "Worker %p can't use %s backend, falling back to epoll\n", worker, worker->backend->name);
+        worker->backend = &server_worker_epoll_backend;
+        if ( worker->backend->init(worker) ) goto free_timer_event;
+    }
 
-    if ( pthread_mutex_init(&worker->clients_mtx, NULL) ) goto close_epfd;
+    if ( pthread_mutex_init(&worker->listeners_mtx, NULL) ) goto fini_backend;
 
-    if ( pthread_create(&worker->thread, NULL, worker_handler, worker) ) goto destroy_mtx;
+    if ( pthread_create(&worker->thread, NULL, worker_thread, worker) ) goto destroy_listeners_mtx;
 
-    log_msg(LOG_DEBUG, "Worker %p was created\n", worker);
+    log_msg(LOG_DEBUG, "Worker %p was created (%s backend)\n", worker, worker->backend->name);
     return worker;
 
-destroy_mtx:
-    pthread_mutex_destroy(&worker->clients_mtx);
-close_epfd:
-    close(worker->epfd);
+destroy_listeners_mtx:
+    pthread_mutex_destroy(&worker->listeners_mtx);
+fini_backend:
+    worker->stopping = true;
+    worker->backend->fini(worker);
+free_timer_event:
+    free(worker->timer_event);
+close_timerfd:
+    close(worker->timerfd);
+fini_timers:
+    server_timer_wheel_fini(&worker->timers);
+free_handoff_event:
+    free(worker->handoff_event);
+close_handoff_efd:
+    close(worker->handoff_efd);
+free_handoff_ring:
+    free(worker->handoff_ring);
 free_worker:
     free(worker);
     return NULL;
@@ -411,39 +509,168 @@ free_worker:
 
 int server_worker_add_client(struct server_worker *worker, int clientfd, plot_constructor_t pc) {
     assert(worker);
+    assert(clientfd > -1);
+    assert(pc);
 
-    struct client *client = client_create(worker, clientfd, pc);
-    if ( client == NULL ) return -1;
+    // The worker builds the client on its own thread, so we don't wait for plot construction here
+    struct client_handoff *ho;
+    size_t pos = __atomic_load_n(&worker->handoff_tail, __ATOMIC_RELAXED);
+    while ( true ) {
+        ho = &worker->handoff_ring[pos % WORKER_HANDOFF_SLOTS];
+        size_t seq = __atomic_load_n(&ho->seq, __ATOMIC_ACQUIRE);
+
+        if ( seq == pos ) {
+            if ( __atomic_compare_exchange_n(
+                &worker->handoff_tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED
+            ) ) break;
+        } else if ( (ptrdiff_t)(seq - pos) < 0 ) {
+            return -1;   // The worker hasn't taken the slot a lap ago, it's that far behind
+        } else {
+            pos = __atomic_load_n(&worker->handoff_tail, __ATOMIC_RELAXED);   // Another producer claimed it
+        }
+    }
 
-    if ( client_next_task(worker, client) ) {
-        client_disconnect(worker, client);
-        return -1;
+    ho->clientfd = clientfd;
+    ho->pc = pc;
+
+    __atomic_add_fetch(&worker->clients_nr, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&ho->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // The worker takes every filled slot per wakeup, so only the first producer since then has to wake it up
+    if ( !__atomic_exchange_n(&worker->handoff_pending, true, __ATOMIC_ACQ_REL) ) worker_wakeup(worker);
+
+    return 0;
+}
+
+int server_worker_add_listener(struct server_worker *worker, int sockfd, plot_constructor_t pc) {
+    assert(worker);
+    assert(sockfd > -1);
+    assert(pc);
+
+    struct worker_listener *listener = malloc(sizeof(struct worker_listener));
+    if ( listener == NULL ) return -1;
+
+    struct server_worker_event *event = malloc(sizeof(struct server_worker_event));
+    if ( event == NULL ) goto free_listener;
+
+    event->data.listener = listener;
+    event->type = SWET_LISTENER;
+
+    listener->event = event;
+    listener->sockfd = sockfd;
+    listener->pc = pc;
+    listener->active = true;
+    listener->armed = false;
+    listener->accepting = false;
+    listc_init(listener, listeners_ring);
+
+    pthread_mutex_lock(&worker->listeners_mtx);
+
+    if ( worker->backend->listener_watch(worker, listener) ) {
+        pthread_mutex_unlock(&worker->listeners_mtx);
+        goto free_event;
     }
 
+    listc_add_item_back(&worker->listeners, listener, listeners_ring);
+    pthread_mutex_unlock(&worker->listeners_mtx);
+
     return 0;
+
+free_event:
+    free(event);
+free_listener:
+    free(listener);
+    return -1;
+}
+
+int server_worker_remove_listener(struct server_worker *worker, int sockfd) {
+    assert(worker);
+
+    pthread_mutex_lock(&worker->listeners_mtx);
+    if ( worker->listeners != NULL ) {
+        struct worker_listener *iter = worker->listeners;
+        do {
+            if ( iter->sockfd == sockfd ) {
+                worker->backend->listener_unwatch(worker, iter);
+                iter->sockfd = -1;
+                iter->active = false;
+                listc_remove_item(&worker->listeners, iter, listeners_ring);
+                // The worker can hold an event for this listener, so we free it later on the worker side
+                listc_add_item_back(&worker->inactive_listeners, iter, listeners_ring);
+
+                pthread_mutex_unlock(&worker->listeners_mtx);
+                return 0;
+            }
+            iter = listc_get_next(iter, listeners_ring);
+        } while ( iter != worker->listeners );
+    }
+    pthread_mutex_unlock(&worker->listeners_mtx);
+
+    return -1;
 }
 
 unsigned server_worker_get_clients_nr(struct server_worker *worker) {
     assert(worker);
 
 
-    pthread_mutex_lock(&worker->clients_mtx);   // We can use atomics instead of this lock
-    unsigned res = worker->clients_nr;
-    pthread_mutex_unlock(&worker->clients_mtx);
-    return res;
+    return __atomic_load_n(&worker->clients_nr, __ATOMIC_RELAXED);
+}
+
+void server_worker_get_load(struct server_worker *worker, struct server_worker_load *out) {
+    assert(worker);
+    assert(out);
+
+    out->clients_nr = __atomic_load_n(&worker->clients_nr, __ATOMIC_RELAXED);
+    out->send_bytes = __atomic_load_n(&worker->send_bytes, __ATOMIC_RELAXED);
+    out->timers_nr = __atomic_load_n(&worker->timers_nr, __ATOMIC_RELAXED);
+}
+
+void server_worker_merge_accept_stats(struct server_worker *worker, struct server_accept_stats *out) {
+    assert(worker);
+    server_accept_stats_merge(out, &worker->accept_stats);
+}
+
+void server_worker_merge_alloc_stats(struct server_worker *worker, struct slab_stats *out) {
+    assert(worker);
+    slab_stats_merge(out, &worker->clients_cache);
 }
 
 void server_worker_destroy(struct server_worker *worker) {
     assert(worker);
 
-    pthread_cancel(worker->thread);
+    __atomic_store_n(&worker->stopping, true, __ATOMIC_RELEASE);
+    worker_wakeup(worker);
     pthread_join(worker->thread, NULL);
 
-    close(worker->epfd);
-
     while ( worker->clients != NULL ) { client_disconnect(worker, worker->clients); }
 
-    pthread_mutex_destroy(&worker->clients_mtx);
+    // Nobody can add or remove listeners now, the backend drops what it still holds
+    worker->backend->fini(worker);
+    slab_cache_fini(&worker->clients_cache);   // The backend has freed every client
+    slab_cache_fini(&worker->recv_cache);
+
+    free(worker->timer_event);
+    close(worker->timerfd);
+    server_timer_wheel_fini(&worker->timers);
+
+    // Nobody can push now, the server stopped acceptors before us
+    size_t tail = __atomic_load_n(&worker->handoff_tail, __ATOMIC_ACQUIRE);
+    for ( size_t pos = worker->handoff_head; pos != tail; pos++ ) {
+        close(worker->handoff_ring[pos % WORKER_HANDOFF_SLOTS].clientfd);
+    }
+    free(worker->handoff_ring);
+    close(worker->handoff_efd);
+    free(worker->handoff_event);
+
+    // Listener sockets belong to the server, we only free our bookkeeping
+    while ( worker->listeners != NULL ) {
+        struct worker_listener *listener = worker->listeners;
+        listc_remove_item(&worker->listeners, listener, listeners_ring);
+        worker_listener_destroy(listener);
+    }
+    worker_cleanup_inactive_listeners(worker);
+
+    pthread_mutex_destroy(&worker->listeners_mtx);
 
     log_msg(LOG_DEBUG, "Worker %p was destroyed\n", worker);
     free(worker);
@@ -1,18 +1,37 @@
 #pragma once
 
 #include "plot.h"
+#include "server.h"
 
 struct server_worker;
 
+// A snapshot of the worker counters, they can be stale by the time you look at them
+struct server_worker_load {
+    unsigned clients_nr;
+    size_t send_bytes;
+    unsigned timers_nr;
+};
+
 [[gnu::malloc]]
-struct server_worker *server_worker_create();
+struct server_worker *server_worker_create(const struct server_config *config);
+// Can be called from any thread, the worker builds the client on its own. clientfd has to be nonblocking
 int server_worker_add_client(struct server_worker *worker, int clientfd, plot_constructor_t pc);
+int server_worker_add_listener(struct server_worker *worker, int sockfd, plot_constructor_t pc);
+int server_worker_remove_listener(struct server_worker *worker, int sockfd);
 unsigned server_worker_get_clients_nr(struct server_worker *worker);
+void server_worker_get_load(struct server_worker *worker, struct server_worker_load *out);
+void server_worker_merge_accept_stats(struct server_worker *worker, struct server_accept_stats *out);
+void server_worker_merge_alloc_stats(struct server_worker *worker, struct slab_stats *out);
 void server_worker_destroy(struct server_worker *worker);
 
 struct server_worker_pool;
 
 [[gnu::malloc]]
-struct server_worker_pool *server_worker_pool_create(unsigned workers_nr);
+struct server_worker_pool *server_worker_pool_create(const struct server_config *config);
 int server_worker_pool_add_client(struct server_worker_pool *pool, int clientfd, plot_constructor_t pc);
+unsigned server_worker_pool_get_workers_nr(struct server_worker_pool *pool);
+int server_worker_pool_add_listener(struct server_worker_pool *pool, unsigned worker_index, int sockfd, plot_constructor_t pc);
+int server_worker_pool_remove_listener(struct server_worker_pool *pool, unsigned worker_index, int sockfd);
+void server_worker_pool_merge_accept_stats(struct server_worker_pool *pool, struct server_accept_stats *out);
+void server_worker_pool_merge_alloc_stats(struct server_worker_pool *pool, struct slab_stats *out);
 void server_worker_pool_destroy(struct server_worker_pool *pool);
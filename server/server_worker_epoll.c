@@ -0,0 +1,283 @@
+#define _GNU_SOURCE
+#include "server_worker_priv.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "bstream.h"
+#include "listc.h"
+#include "log.h"
+#include "server_accept.h"
+
+struct worker_epoll {
+    int epfd;
+    struct epoll_event *evs;
+    unsigned evs_nr;
+
+    // Disconnected during the current batch, later events of the batch can still point to them
+    struct client *released_clients;
+};
+
+static int worker_epfd(struct server_worker *worker) {
+    return ((struct worker_epoll *)worker->backend_data)->epfd;
+}
+
+// One recv per readable event, epoll reports the rest again. Returns -1 if the client was disconnected
+static int client_recv_answer(struct server_worker *worker, struct client *client) {
+    size_t space;
+    char *dest = client_recv_space(worker, client, &space);
+    if ( dest == NULL ) {
+        log_msg(LOG_DEBUG, "Client %p was disconnected because of too long answer\n", client);
+        client_disconnect(worker, client);
+        return -1;
+    }
+
+    ssize_t res = recv(client->sockfd, dest, space, MSG_DONTWAIT);
+    if ( res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ) return 0;
+    if ( res <= 0 ) {
+        log_msg(LOG_DEBUG, "Client %p disconnected\n", client);
+        client_disconnect(worker, client);
+        return -1;
+    }
+
+    client->recv_len += res;
+    return client_handle_received(worker, client);
+}
+
+static int epoll_client_watch(struct server_worker *worker, struct client *client) {
+    // Opt-in, big questions are sent without copying where the kernel can do it, the completions come as EPOLLERR
+    int one = 1;
+    if ( worker->zerocopy_min != 0 &&
+         setsockopt(client->sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0 )
+        bstream_set_zerocopy(&client->send_stream, worker->zerocopy_min);
+
+    struct epoll_event ev = {.events = EPOLLRDHUP, .data.ptr = &client->event};
+    return epoll_ctl(worker_epfd(worker), EPOLL_CTL_ADD, client->sockfd, &ev);
+}
+
+static int epoll_client_send(struct server_worker *worker, struct client *client) {
+    struct epoll_event ev = {
+        .data.ptr = &client->event,
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP
+    };   // Poll for EPOLLOUT now
+
+    // Notice that we only modify epoll entry, it must be added before this
+    return epoll_ctl(worker_epfd(worker), EPOLL_CTL_MOD, client->sockfd, &ev);
+}
+
+static void epoll_client_release(struct server_worker *worker, struct client *client) {
+    struct worker_epoll *ep = worker->backend_data;
+
+    epoll_ctl(ep->epfd, EPOLL_CTL_DEL, client->sockfd, NULL);
+    if ( bstream_zerocopy_pending(&client->send_stream) ) {
+        // Otherwise close() keeps sending from the buffers client_free gives back. Reset drops the queue
+        struct linger lg = {.l_onoff = 1, .l_linger = 0};
+        setsockopt(client->sockfd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    close(client->sockfd);
+    client->released = true;
+    listc_add_item_back(&ep->released_clients, client, client_ring);
+}
+
+static int client_send_text(struct server_worker *worker, struct client *client) {
+    assert(worker);
+    assert(client);
+
+    struct bstream *bst = &client->send_stream;
+    if ( bstream_len(bst) == 0 ) return 0;   // No questions for client now
+
+    size_t written;
+    enum bstream_send_res res = bstream_send_sock(bst, client->sockfd, bstream_len(bst), &written);
+    worker_sub_send_bytes(worker, written);
+    if ( res == BSTREAM_SEND_ERROR ) {
+        log_msg(LOG_DEBUG, "Failed to send data to clientfd %d: %s\n", client->sockfd, strerror(errno));
+        return -1;
+    }
+
+    if ( bstream_len(bst) == 0 ) {
+        // bstream_flush(&client->send_stream);   // We don't want to flush the buffer because it alredy has zero len
+        struct epoll_event ev = {.data.ptr = &client->event, .events = EPOLLIN | EPOLLRDHUP};
+
+        if ( epoll_ctl(worker_epfd(worker), EPOLL_CTL_MOD, client->sockfd, &ev) )   // We aren't interested in writting now
+            return -1;
+
+        client_question_sent(worker, client);
+    }
+
+    return 0;
+}
+
+static int epoll_listener_watch(struct server_worker *worker, struct worker_listener *listener) {
+    struct epoll_event ev = {.data.ptr = listener->event, .events = EPOLLIN};
+    return epoll_ctl(worker_epfd(worker), EPOLL_CTL_ADD, listener->sockfd, &ev);
+}
+
+static void epoll_listener_unwatch(struct server_worker *worker, struct worker_listener *listener) {
+    epoll_ctl(worker_epfd(worker), EPOLL_CTL_DEL, listener->sockfd, NULL);
+}
+
+struct worker_accept_ctx {
+    struct server_worker *worker;
+    plot_constructor_t pc;
+};
+
+static int worker_accept_handler(void *arg, int clientfd) {
+    struct worker_accept_ctx *ctx = arg;
+    return worker_accept_client(ctx->worker, clientfd, ctx->pc);
+}
+
+static void worker_listener_accept(struct server_worker *worker, struct worker_listener *listener) {
+    pthread_mutex_lock(&worker->listeners_mtx);
+
+    // Listener was removed after epoll had reported it. It's freed after the batch, like in server.c
+    if ( !listener->active ) {
+        pthread_mutex_unlock(&worker->listeners_mtx);
+        return;
+    }
+
+    struct worker_accept_ctx ctx = {.worker = worker, .pc = listener->pc};
+    unsigned accepted = server_accept_batch(listener->sockfd, worker->accept_batch, worker_accept_handler, &ctx);
+    pthread_mutex_unlock(&worker->listeners_mtx);
+
+    server_accept_stats_account(&worker->accept_stats, accepted);
+}
+
+static void epoll_handle_event(struct server_worker *w, struct epoll_event *ev) {
+    struct server_worker_event *event = ev->data.ptr;
+
+    if ( event->type == SWET_TIMER ) {
+        worker_expire_timers(w);
+    } else if ( event->type == SWET_CLIENT ) {
+        struct client *client = event->data.client;
+        if ( client->released ) return;   // Disconnected earlier in this batch
+
+        if ( ev->events & EPOLLERR ) {
+            // Zerocopy completions share the error queue with real errors, the latter also end up in SO_ERROR
+            int err = 0;
+            socklen_t err_len = sizeof(err);
+            if ( bstream_reap_zerocopy(&client->send_stream, client->sockfd) ||
+                 (getsockopt(client->sockfd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 && err != 0) ) {
+                log_msg(LOG_DEBUG, "Client %p was disconnected because of socket error\n", client);
+                client_disconnect(w, client);
+                return;
+            }
+        }
+
+        if ( ev->events & EPOLLIN ) {
+            if ( client->current_task != NULL ) {
+                if ( client_recv_answer(w, client) ) return;
+            }
+        }
+
+        if ( ev->events & EPOLLOUT ) {
+            if ( client_send_text(w, client) ) {
+                log_msg(LOG_DEBUG, "Client %p was disconnected because of sending problem\n", client);
+                client_disconnect(w, client);
+                return;
+            }
+        }
+
+        if ( ev->events & EPOLLRDHUP ) {
+            log_msg(LOG_DEBUG, "Client %p disconnected\n", client);
+            client_disconnect(w, client);
+            return;
+        }
+    } else if ( event->type == SWET_LISTENER ) {
+        assert(ev->events == EPOLLIN);
+        worker_listener_accept(w, event->data.listener);
+    } else if ( event->type == SWET_HANDOFF ) {
+        uint64_t cnt;
+        read(w->handoff_efd, &cnt, sizeof(cnt));   // Reset the eventfd, it's nonblocking
+        if ( !worker_stopping(w) ) worker_take_handoffs(w);
+    } else {
+        assert(0);
+    }
+}
+
+// Nothing points to released clients after the batch, so we free them here
+static void epoll_free_released(struct server_worker *worker) {
+    struct worker_epoll *ep = worker->backend_data;
+
+    while ( ep->released_clients != NULL ) {
+        struct client *client = ep->released_clients;
+        listc_remove_item(&ep->released_clients, client, client_ring);
+        client_free(worker, client);
+    }
+
+    pthread_mutex_lock(&worker->listeners_mtx);
+    worker_cleanup_inactive_listeners(worker);
+    pthread_mutex_unlock(&worker->listeners_mtx);
+}
+
+static void epoll_loop(struct server_worker *w) {
+    struct worker_epoll *ep = w->backend_data;
+
+    while ( !worker_stopping(w) ) {
+        int res = epoll_wait(ep->epfd, ep->evs, ep->evs_nr, -1);
+        if ( res == -1 && errno == EINTR ) continue;
+        assert(res != -1);
+
+        // Events are handled in the order epoll gave them, a handler can drop objects later events point to
+        for ( int i = 0; i < res; i++ ) epoll_handle_event(w, &ep->evs[i]);
+
+        epoll_free_released(w);
+    }
+}
+
+static int epoll_init(struct server_worker *worker) {
+    struct worker_epoll *ep = malloc(sizeof(struct worker_epoll));
+    if ( ep == NULL ) return -1;
+
+    ep->evs_nr = worker->events_batch;
+    ep->evs = malloc(sizeof(struct epoll_event) * ep->evs_nr);
+    if ( ep->evs == NULL ) goto free_ep;
+
+    ep->released_clients = NULL;
+
+    ep->epfd = epoll_create1(0);
+    if ( ep->epfd == -1 ) goto free_evs;
+
+    struct epoll_event ev = {.data.ptr = worker->handoff_event, .events = EPOLLIN};
+    if ( epoll_ctl(ep->epfd, EPOLL_CTL_ADD, worker->handoff_efd, &ev) ) goto close_epfd;
+
+    ev = (struct epoll_event){.data.ptr = worker->timer_event, .events = EPOLLIN};
+    if ( epoll_ctl(ep->epfd, EPOLL_CTL_ADD, worker->timerfd, &ev) ) goto close_epfd;
+
+    worker->backend_data = ep;
+    return 0;
+
+close_epfd:
+    close(ep->epfd);
+free_evs:
+    free(ep->evs);
+free_ep:
+    free(ep);
+    return -1;
+}
+
+static void epoll_fini(struct server_worker *worker) {
+    struct worker_epoll *ep = worker->backend_data;
+    epoll_free_released(worker);   // server_worker_destroy disconnects clients after the loop
+    close(ep->epfd);
+    free(ep->evs);
+    free(ep);
+    worker->backend_data = NULL;
+}
+
+const struct server_worker_backend server_worker_epoll_backend = {
+    .name = "epoll",
+    .init = epoll_init,
+    .fini = epoll_fini,
+    .loop = epoll_loop,
+    .client_watch = epoll_client_watch,
+    .client_send = epoll_client_send,
+    .client_release = epoll_client_release,
+    .listener_watch = epoll_listener_watch,
+    .listener_unwatch = epoll_listener_unwatch
+};
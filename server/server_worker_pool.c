@@ -1,37 +1,142 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include "log.h"
 #include "plot.h"
+#include "rand.h"
 #include "server_worker.h"
 
+struct server_worker_pool;
+
+typedef struct server_worker *(*server_worker_pool_pick_t)(struct server_worker_pool *pool);
+
+struct server_balancer {
+    const char *name;
+    server_worker_pool_pick_t pick;
+};
+
 struct server_worker_pool {
     struct server_worker **workers;
     unsigned workers_nr;
+    const struct server_balancer *balancer;
+    unsigned rr_next;   // Atomic
+};
+
+// Weights of the cost policy, a queued KiB costs one unit
+#define SERVER_BALANCE_CLIENT_COST 4u
+#define SERVER_BALANCE_TIMER_COST 2u
+#define SERVER_BALANCE_SEND_BYTES_SHIFT 10
+
+static struct server_worker *pool_pick_least_clients(struct server_worker_pool *pool) {
+    struct server_worker *laziest_worker = pool->workers[0];
+    unsigned min_clients_nr = server_worker_get_clients_nr(pool->workers[0]);
+    for ( unsigned i = 1; i < pool->workers_nr; i++ ) {
+        unsigned clients_nr = server_worker_get_clients_nr(pool->workers[i]);
+        if ( min_clients_nr > clients_nr ) {
+            laziest_worker = pool->workers[i];
+            min_clients_nr = clients_nr;
+        }
+    }
+
+    return laziest_worker;
+}
+
+static struct server_worker *pool_pick_round_robin(struct server_worker_pool *pool) {
+    unsigned next = __atomic_fetch_add(&pool->rr_next, 1u, __ATOMIC_RELAXED);
+    return pool->workers[next % pool->workers_nr];
+}
+
+static struct server_worker *pool_pick_two_choices(struct server_worker_pool *pool) {
+    if ( pool->workers_nr == 1 ) return pool->workers[0];
+
+    unsigned first = rand_below(pool->workers_nr);
+    unsigned second = rand_below(pool->workers_nr - 1);
+    if ( second >= first ) second++;   // Two distinct workers
+
+    struct server_worker *a = pool->workers[first];
+    struct server_worker *b = pool->workers[second];
+
+    return server_worker_get_clients_nr(a) <= server_worker_get_clients_nr(b) ? a : b;
+}
+
+static unsigned long pool_worker_cost(struct server_worker *worker) {
+    struct server_worker_load load;
+    server_worker_get_load(worker, &load);
+
+    return (unsigned long)load.clients_nr * SERVER_BALANCE_CLIENT_COST +
+           (unsigned long)load.timers_nr * SERVER_BALANCE_TIMER_COST +
+           (load.send_bytes >> SERVER_BALANCE_SEND_BYTES_SHIFT);
+}
+
+static struct server_worker *pool_pick_cost(struct server_worker_pool *pool) {
+    struct server_worker *cheapest_worker = pool->workers[0];
+    unsigned long min_cost = pool_worker_cost(pool->workers[0]);
+    for ( unsigned i = 1; i < pool->workers_nr; i++ ) {
+        unsigned long cost = pool_worker_cost(pool->workers[i]);
+        if ( min_cost > cost ) {
+            cheapest_worker = pool->workers[i];
+            min_cost = cost;
+        }
+    }
+
+    return cheapest_worker;
+}
+
+static const struct server_balancer balancers[SERVER_BALANCE_POLICIES_NR] = {
+    [SERVER_BALANCE_LEAST_CLIENTS] = {.name = "least", .pick = pool_pick_least_clients},
+    [SERVER_BALANCE_ROUND_ROBIN] = {.name = "rr", .pick = pool_pick_round_robin},
+    [SERVER_BALANCE_TWO_CHOICES] = {.name = "p2c", .pick = pool_pick_two_choices},
+    [SERVER_BALANCE_COST] = {.name = "cost", .pick = pool_pick_cost}
 };
 
-struct server_worker_pool *server_worker_pool_create(unsigned workers_nr) {
+int server_balance_policy_from_name(const char *name, enum server_balance_policy *out) {
+    assert(name);
+    assert(out);
+
+    for ( unsigned i = 0; i < SERVER_BALANCE_POLICIES_NR; i++ ) {
+        if ( !strcmp(balancers[i].name, name) ) {
+            *out = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+const char *server_balance_policy_name(enum server_balance_policy policy) {
+    assert(policy < SERVER_BALANCE_POLICIES_NR);
+    return balancers[policy].name;
+}
+
+struct server_worker_pool *server_worker_pool_create(const struct server_config *config) {
+    assert(config);
+    assert(config->balance < SERVER_BALANCE_POLICIES_NR);
+    unsigned workers_nr = config->workers_nr;
     assert(workers_nr > 0);
 
     struct server_worker_pool *pool = malloc(sizeof(struct server_worker_pool));
     if ( pool == NULL ) return NULL;
 
     pool->workers = malloc(sizeof(struct server_worker *) * workers_nr);
+    if ( pool->workers == NULL ) goto free_pool;
     pool->workers_nr = workers_nr;
+    pool->balancer = &balancers[config->balance];
+    pool->rr_next = 0;
 
     for ( unsigned i = 0; i < workers_nr; i++ ) {
-        pool->workers[i] = server_worker_create();
+        pool->workers[i] = server_worker_create(config);
 
         if ( pool->workers[i] == NULL ) { // destroy created workers
-            for ( unsigned j = 0; j < i; j++ ) {
-                server_worker_destroy(pool->workers[j]);
-                goto free_pool;
-            }
+            for ( unsigned j = 0; j < i; j++ ) server_worker_destroy(pool->workers[j]);
+            goto free_workers;
         }
     }
 
-    log_msg(LOG_DEBUG, "Worker pool %p was created\n", pool);
+    log_msg(LOG_DEBUG, "Worker pool %p was created (%s balancing)\n", pool, pool->balancer->name);
     return pool;
 
+free_workers:
+    free(pool->workers);
 free_pool:
     free(pool);
     return NULL;
@@ -42,17 +147,36 @@ int server_worker_pool_add_client(struct server_worker_pool *pool, int clientfd,
     assert(clientfd > -1);
     assert(pc);
 
-    struct server_worker *laziest_worker = pool->workers[0];
-    unsigned min_clients_nr = server_worker_get_clients_nr(pool->workers[0]);
-    for ( unsigned i = 1; i < pool->workers_nr; i++ ) {
-        unsigned clients_nr = server_worker_get_clients_nr(pool->workers[i]);
-        if ( min_clients_nr > clients_nr ) {
-            laziest_worker = pool->workers[i];
-            min_clients_nr = clients_nr;
-        }
-    }
+    return server_worker_add_client(pool->balancer->pick(pool), clientfd, pc);
+}
+
+unsigned server_worker_pool_get_workers_nr(struct server_worker_pool *pool) {
+    assert(pool);
+    return pool->workers_nr;
+}
+
+int server_worker_pool_add_listener(struct server_worker_pool *pool, unsigned worker_index, int sockfd, plot_constructor_t pc) {
+    assert(pool);
+    assert(worker_index < pool->workers_nr);
+
+    return server_worker_add_listener(pool->workers[worker_index], sockfd, pc);
+}
 
-    return server_worker_add_client(laziest_worker, clientfd, pc);
+int server_worker_pool_remove_listener(struct server_worker_pool *pool, unsigned worker_index, int sockfd) {
+    assert(pool);
+    assert(worker_index < pool->workers_nr);
+
+    return server_worker_remove_listener(pool->workers[worker_index], sockfd);
+}
+
+void server_worker_pool_merge_accept_stats(struct server_worker_pool *pool, struct server_accept_stats *out) {
+    assert(pool);
+    for ( unsigned i = 0; i < pool->workers_nr; i++ ) server_worker_merge_accept_stats(pool->workers[i], out);
+}
+
+void server_worker_pool_merge_alloc_stats(struct server_worker_pool *pool, struct slab_stats *out) {
+    assert(pool);
+    for ( unsigned i = 0; i < pool->workers_nr; i++ ) server_worker_merge_alloc_stats(pool->workers[i], out);
 }
 
 void server_worker_pool_destroy(struct server_worker_pool *pool) {
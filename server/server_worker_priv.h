@@ -0,0 +1,157 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include "bstream.h"
+#include "listc.h"
+#include "server_timer_wheel.h"
+#include "slab.h"
+#include "server_worker.h"
+
+// Shared between the worker core and its event loop backends, nobody else should include it
+
+#define CLIENT_RECV_BUF_MIN 512u
+#define CLIENT_RECV_BUF_MAX (1u << 20)   // Eq answers are long numbers, but not that long
+
+struct client;
+struct worker_listener;
+
+enum server_worker_event_type {
+    SWET_TIMER,   // The worker timerfd
+    SWET_CLIENT,
+    SWET_LISTENER,
+    SWET_HANDOFF
+};
+
+struct server_worker_event {
+    union {
+        struct client *client;
+        struct worker_listener *listener;
+    } data;
+    enum server_worker_event_type type;
+};
+
+struct client {
+    int sockfd;
+    struct listc client_ring;
+    struct server_timer deadline;   // Of the current task
+    struct server_worker_event event;
+
+    struct plot *plot;
+    struct plot_task *current_task;
+    struct question *current_question;   // Only while the send stream borrows its text
+    struct bstream send_stream;
+
+    char *recv_buf;      // Received bytes the current task hasn't consumed yet, allocated on the first receive
+    size_t recv_len;
+    size_t recv_size;
+
+    bool released;   // The core is done with the client, the backend frees it when nothing points to it
+
+    unsigned inflight;   // uring backend only, submitted requests that still reference the client
+    bool sending;        // uring backend only, the kernel reads send_stream in place, answers wait for the send
+};
+
+struct worker_listener {
+    int sockfd;
+    plot_constructor_t pc;
+    struct listc listeners_ring;
+    struct server_worker_event *event;
+    bool active;
+    bool armed;       // The backend still holds the listener, it can't be freed yet
+    bool accepting;   // uring backend only, the multishot accept is submitted
+};
+
+// Slot of the handoff ring for a connection on its way from an acceptor thread to the worker
+struct client_handoff {
+    size_t seq;   // Atomic, the slot is free for the producer of pos if seq == pos, filled for the worker if pos + 1
+    int clientfd;
+    plot_constructor_t pc;
+};
+
+struct server_worker_backend;
+
+struct server_worker {
+    const struct server_worker_backend *backend;
+    void *backend_data;
+    pthread_t thread;
+    bool stopping;            // Atomic, the loop returns once it sees it
+    struct client *clients;   // Only the worker thread touches clients
+    unsigned clients_nr;      // Atomic, counts clients that are still in the handoff queue too
+    size_t send_bytes;        // Atomic, bytes queued in the send streams of all clients
+    unsigned timers_nr;       // Atomic, pending task deadlines
+
+    // Only the worker thread allocates from them, so connections don't touch the global allocator
+    struct slab_cache clients_cache;
+    struct slab_cache recv_cache;   // First CLIENT_RECV_BUF_MIN bytes of receive buffers
+
+    struct server_timer_wheel timers;   // Task deadlines of all clients
+    int timerfd;                        // Ticks the wheel while anything is armed
+    bool timerfd_armed;
+    struct server_worker_event *timer_event;
+
+    // Bounded lock-free MPSC ring, producers claim slots at the tail, the worker takes them from the head
+    struct client_handoff *handoff_ring;
+    size_t handoff_tail;     // Atomic
+    size_t handoff_head;     // Only the worker thread touches it
+    bool handoff_pending;    // Atomic, a producer has woken the worker up since it last took handoffs
+    int handoff_efd;
+    struct server_worker_event *handoff_event;
+
+    struct worker_listener *listeners;
+    struct worker_listener *inactive_listeners;
+    pthread_mutex_t listeners_mtx;
+    unsigned accept_batch;
+    unsigned events_batch;
+    size_t zerocopy_min;   // 0 if the sockets don't get SO_ZEROCOPY at all
+    struct server_accept_stats accept_stats;
+};
+
+/*
+ * Event loop backend. The core owns clients and listeners and tells the backend when it has to start
+ * or stop watching them, handoff_efd and timerfd are watched all the time. All ops but listener_watch
+ * and listener_unwatch are called from the worker thread (or from server_worker_destroy after the thread
+ * is gone). Listener ops are called under listeners_mtx from any thread, the worker is woken up through
+ * handoff_efd then
+ */
+struct server_worker_backend {
+    const char *name;
+    int (*init)(struct server_worker *worker);
+    void (*fini)(struct server_worker *worker);
+    void (*loop)(struct server_worker *worker);   // Runs in the worker thread until worker_stopping()
+
+    int (*client_watch)(struct server_worker *worker, struct client *client);
+    int (*client_send)(struct server_worker *worker, struct client *client);   // The send stream has a new question
+    void (*client_release)(struct server_worker *worker, struct client *client);   // Frees the client, now or later
+
+    int (*listener_watch)(struct server_worker *worker, struct worker_listener *listener);
+    void (*listener_unwatch)(struct server_worker *worker, struct worker_listener *listener);
+};
+
+extern const struct server_worker_backend server_worker_epoll_backend;
+extern const struct server_worker_backend server_worker_uring_backend;
+
+// Worker core helpers for the backends
+
+extern bool worker_stopping(struct server_worker *worker);
+extern void worker_wakeup(struct server_worker *worker);
+extern void worker_add_send_bytes(struct server_worker *worker, size_t bytes);
+extern void worker_sub_send_bytes(struct server_worker *worker, size_t bytes);
+
+extern void client_disconnect(struct server_worker *wr, struct client *cl);
+// The whole question has left the send stream, the task deadline starts
+extern void client_question_sent(struct server_worker *worker, struct client *client);
+// Returns -1 if the client was disconnected
+extern int client_handle_answer(struct server_worker *worker, struct client *client, enum answer_state res);
+// Free space at the end of recv_buf, NULL if the answer doesn't fit into CLIENT_RECV_BUF_MAX
+extern char *client_recv_space(struct server_worker *worker, struct client *client, size_t *space);
+// Gives the client memory back once the backend is done with it, its socket has to be closed by then
+extern void client_free(struct server_worker *worker, struct client *client);
+// recv_len has grown, checks every answer the buffer holds. Returns -1 if the client was disconnected
+extern int client_handle_received(struct server_worker *worker, struct client *client);
+
+extern void worker_take_handoffs(struct server_worker *worker);
+// timerfd is readable, expired clients are disconnected
+extern void worker_expire_timers(struct server_worker *worker);
+extern void worker_cleanup_inactive_listeners(struct server_worker *worker);
+extern int worker_accept_client(struct server_worker *worker, int clientfd, plot_constructor_t pc);
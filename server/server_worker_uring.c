@@ -0,0 +1,529 @@
+#define _GNU_SOURCE
+#include "server_worker_priv.h"
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "bstream.h"
+#include "log.h"
+#include "plot.h"
+#include "server_accept.h"
+#include "slab.h"
+#include "uring.h"
+#include "utils.h"
+
+#define URING_ENTRIES 1024u
+#define URING_BUFS_NR 256u
+#define URING_BUF_SIZE 4096u
+#define URING_BGID 0
+#define URING_SEND_IOV 8u   // Segments per send, a question is only a couple of them
+#define URING_SENDS_PER_SLAB 64u
+
+// Linked files and CQE skipping came in 5.17, the latter makes cancels free. Multishot recv has no feature
+// bit, uring_probe_multishot_recv checks it on its own
+#define URING_REQUIRED_FEATURES (IORING_FEAT_LINKED_FILE | IORING_FEAT_CQE_SKIP)
+
+// The request kind lives in the low bits of user_data, the rest is a pointer
+enum uring_op {
+    UOP_IGNORE,
+    UOP_RECV,      // Client event
+    UOP_SEND,      // struct uring_send
+    UOP_TICK,      // Worker timer event
+    UOP_ACCEPT,    // Listener event
+    UOP_HANDOFF,   // Handoff event
+    UOP_MASK = 7
+};
+
+// A sendmsg over the head of the client's send stream, the kernel reads the segments in place until it completes
+struct uring_send {
+    struct client *client;
+    size_t len;   // Of all iov segments
+    struct msghdr msg;
+    struct iovec iov[URING_SEND_IOV];
+    struct __kernel_timespec timeout;   // Of the linked timeout
+};
+
+struct worker_uring {
+    struct uring ring;
+    struct uring_buf_ring bufs;
+    struct slab_cache sends_cache;
+    unsigned inflight;       // Requests that will post one more completion at least
+    bool listeners_dirty;    // Atomic, listeners were added or removed by another thread
+};
+
+static struct worker_uring *worker_uring(struct server_worker *worker) {
+    return worker->backend_data;
+}
+
+static uint64_t uring_ud(void *ptr, enum uring_op op) {
+    assert(((uintptr_t)ptr & UOP_MASK) == 0);
+    return (uintptr_t)ptr | op;
+}
+
+static void *uring_ud_ptr(uint64_t ud) {
+    return (void *)(uintptr_t)(ud & ~(uint64_t)UOP_MASK);
+}
+
+// Worker eventfd and timerfd are read with plain read() when the multishot poll reports them
+static void uring_arm_poll(struct server_worker *worker, int fd, struct server_worker_event *event, enum uring_op op) {
+    struct worker_uring *u = worker_uring(worker);
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = uring_ud(event, op);
+    u->inflight++;
+}
+
+static void uring_arm_recv(struct server_worker *worker, struct client *client) {
+    struct worker_uring *u = worker_uring(worker);
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->sockfd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = uring_ud(&client->event, UOP_RECV);
+    client->inflight++;
+    u->inflight++;
+}
+
+static void uring_arm_accept(struct server_worker *worker, struct worker_listener *listener) {
+    struct worker_uring *u = worker_uring(worker);
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener->sockfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = uring_ud(listener->event, UOP_ACCEPT);
+    listener->accepting = true;
+    u->inflight++;
+}
+
+static void uring_cancel(struct server_worker *worker, uint64_t ud) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&worker_uring(worker)->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = ud;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = uring_ud(NULL, UOP_IGNORE);
+}
+
+static int uring_client_watch(struct server_worker *worker, struct client *client) {
+    uring_arm_recv(worker, client);
+    return 0;
+}
+
+static void uring_client_put(struct server_worker *worker, struct client *client) {
+    if ( client->inflight > 0 ) return;
+
+    close(client->sockfd);
+    client_free(worker, client);
+}
+
+static void uring_client_release(struct server_worker *worker, struct client *client) {
+    // The pending recv completes with EOF and sends fail, the last completion frees the client
+    client->released = true;
+    shutdown(client->sockfd, SHUT_RDWR);
+    uring_client_put(worker, client);
+}
+
+// The stream stays as it is until the completion, which consumes what the kernel has sent
+static int uring_submit_send(struct server_worker *worker, struct client *client) {
+    struct worker_uring *u = worker_uring(worker);
+
+    struct uring_send *send = slab_alloc(&u->sends_cache);
+    if ( send == NULL ) return -1;
+
+    int iovcnt = bstream_get_iov(&client->send_stream, send->iov, URING_SEND_IOV);
+    if ( iovcnt == 0 ) {   // Questions never have file ranges
+        slab_free(&u->sends_cache, send);
+        return -1;
+    }
+
+    send->client = client;
+    send->len = 0;
+    for ( int i = 0; i < iovcnt; i++ ) send->len += send->iov[i].iov_len;
+    send->msg = (struct msghdr){.msg_iov = send->iov, .msg_iovlen = iovcnt};
+
+    unsigned long timeout = plot_task_get_timeout_msec(client->current_task);
+    uring_reserve_sqes(&u->ring, 2);
+
+    // MSG_WAITALL makes the kernel finish short sends on its own, so a short completion is an error or the timeout
+    struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = client->sockfd;
+    sqe->addr = (uintptr_t)&send->msg;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = uring_ud(send, UOP_SEND);
+
+    // A client that doesn't read the question for the whole task timeout won't answer in time either
+    if ( timeout != 0 ) {
+        sqe->flags = IOSQE_IO_LINK;
+
+        send->timeout.tv_sec = timeout / 1000;
+        send->timeout.tv_nsec = timeout % 1000 * 1000000;
+
+        sqe = uring_get_sqe(&u->ring);
+        sqe->opcode = IORING_OP_LINK_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t)&send->timeout;
+        sqe->len = 1;
+        sqe->user_data = uring_ud(NULL, UOP_IGNORE);   // Copied on submit, the send completes with ECANCELED
+    }
+
+    client->sending = true;
+    client->inflight++;
+    u->inflight++;
+    return 0;
+}
+
+static int uring_client_send(struct server_worker *worker, struct client *client) {
+    assert(!client->sending);   // Answers wait for the send, so the core can't start the next task meanwhile
+    return uring_submit_send(worker, client);   // The deadline starts when the send completes
+}
+
+static int uring_listener_watch(struct server_worker *worker, struct worker_listener *listener) {
+    // Only the worker thread submits, so it arms the listener on the wakeup
+    listener->armed = true;
+    __atomic_store_n(&worker_uring(worker)->listeners_dirty, true, __ATOMIC_RELEASE);
+    worker_wakeup(worker);
+    return 0;
+}
+
+static void uring_listener_unwatch(struct server_worker *worker, struct worker_listener *listener) {
+    unused(listener);
+    __atomic_store_n(&worker_uring(worker)->listeners_dirty, true, __ATOMIC_RELEASE);
+    worker_wakeup(worker);
+}
+
+static void uring_sync_listeners(struct server_worker *worker) {
+    struct worker_uring *u = worker_uring(worker);
+    if ( !__atomic_exchange_n(&u->listeners_dirty, false, __ATOMIC_ACQUIRE) ) return;
+
+    pthread_mutex_lock(&worker->listeners_mtx);
+
+    if ( worker->listeners != NULL ) {
+        LISTC_FOREACH_START(worker->listeners, listeners_ring, iter)
+        if ( !iter->accepting ) uring_arm_accept(worker, iter);
+        LISTC_FOREACH_END(worker->listeners, listeners_ring, iter)
+    }
+
+    if ( worker->inactive_listeners != NULL ) {
+        LISTC_FOREACH_START(worker->inactive_listeners, listeners_ring, iter)
+        if ( iter->accepting ) {
+            uring_cancel(worker, uring_ud(iter->event, UOP_ACCEPT));
+        } else {
+            iter->armed = false;
+        }
+        LISTC_FOREACH_END(worker->inactive_listeners, listeners_ring, iter)
+    }
+
+    worker_cleanup_inactive_listeners(worker);
+    pthread_mutex_unlock(&worker->listeners_mtx);
+}
+
+static void uring_handle_recv(struct server_worker *worker, struct client *client, struct io_uring_cqe *cqe) {
+    struct worker_uring *u = worker_uring(worker);
+    int res = cqe->res;
+
+    if ( cqe->flags & IORING_CQE_F_BUFFER ) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        const char *data = uring_buf_ring_get(&u->bufs, bid);
+        size_t left = res > 0 ? (size_t)res : 0;
+
+        // The provided buffer goes back to the kernel right away, so the bytes are moved to the client buffer
+        while ( left > 0 && !client->released && client->current_task != NULL ) {
+            size_t space;
+            char *dest = client_recv_space(worker, client, &space);
+            if ( dest == NULL ) {
+                log_msg(LOG_DEBUG, "Client %p was disconnected because of too long answer\n", client);
+                client_disconnect(worker, client);
+                break;
+            }
+
+            size_t chunk = min(space, left);
+            memcpy(dest, data, chunk);
+            client->recv_len += chunk;
+            data += chunk;
+            left -= chunk;
+
+            // client_next_task would flush the stream under the send, the answer is checked once it completes
+            if ( !client->sending && client_handle_received(worker, client) ) break;
+        }
+        uring_buf_ring_recycle(&u->bufs, bid);
+    }
+
+    if ( cqe->flags & IORING_CQE_F_MORE ) return;
+
+    client->inflight--;
+    u->inflight--;
+
+    if ( client->released ) {
+        uring_client_put(worker, client);
+    } else if ( res == -ENOBUFS || res > 0 ) {   // We were out of buffers, or the kernel just stopped the multishot
+        uring_arm_recv(worker, client);
+    } else {
+        log_msg(LOG_DEBUG, "Client %p disconnected\n", client);
+        client_disconnect(worker, client);
+    }
+}
+
+static void uring_handle_send(struct server_worker *worker, struct uring_send *send, int res) {
+    struct worker_uring *u = worker_uring(worker);
+    struct client *client = send->client;
+
+    client->inflight--;
+    u->inflight--;
+    client->sending = false;
+    size_t len = send->len;
+    slab_free(&u->sends_cache, send);
+
+    if ( client->released ) {
+        uring_client_put(worker, client);
+        return;
+    }
+
+    if ( res > 0 ) {
+        bstream_consume(&client->send_stream, res);
+        worker_sub_send_bytes(worker, res);
+    }
+
+    if ( res < 0 || (size_t)res < len ) {
+        log_msg(LOG_DEBUG, "Client %p was disconnected because of sending problem\n", client);
+        client_disconnect(worker, client);
+    } else if ( bstream_len(&client->send_stream) > 0 ) {   // More segments than one send takes
+        if ( uring_submit_send(worker, client) ) client_disconnect(worker, client);
+    } else {
+        client_question_sent(worker, client);
+        client_handle_received(worker, client);   // Answers that came while the question was sent
+    }
+}
+
+static unsigned uring_handle_accept(struct server_worker *worker, struct worker_listener *listener, struct io_uring_cqe *cqe) {
+    struct worker_uring *u = worker_uring(worker);
+    unsigned accepted = 0;
+
+    pthread_mutex_lock(&worker->listeners_mtx);
+
+    bool stopping = worker_stopping(worker);
+
+    if ( cqe->res >= 0 ) {
+        if ( listener->active && !stopping && !worker_accept_client(worker, cqe->res, listener->pc) ) {
+            accepted = 1;
+        } else {
+            if ( listener->active ) log_msg(LOG_WARN, "Failed to bind client\n");
+            close(cqe->res);
+        }
+    }
+
+    if ( !(cqe->flags & IORING_CQE_F_MORE) ) {
+        u->inflight--;
+        listener->accepting = false;
+
+        if ( listener->active && !stopping ) {
+            if ( cqe->res < 0 ) log_msg(LOG_WARN, "Accept failed on worker %p: %s\n", worker, strerror(-cqe->res));
+            uring_arm_accept(worker, listener);
+        } else {
+            listener->armed = false;
+            worker_cleanup_inactive_listeners(worker);   // Listener can be freed here
+        }
+    }
+
+    pthread_mutex_unlock(&worker->listeners_mtx);
+    return accepted;
+}
+
+static void uring_handle_handoff(struct server_worker *worker, struct io_uring_cqe *cqe) {
+    struct worker_uring *u = worker_uring(worker);
+
+    bool stopping = worker_stopping(worker);
+
+    uint64_t cnt;
+    read(worker->handoff_efd, &cnt, sizeof(cnt));   // Reset the eventfd, it's nonblocking
+
+    // server_worker_destroy drops queued clients on its own
+    if ( !stopping ) {
+        worker_take_handoffs(worker);
+        uring_sync_listeners(worker);
+    }
+
+    if ( !(cqe->flags & IORING_CQE_F_MORE) ) {
+        u->inflight--;
+        if ( !stopping ) uring_arm_poll(worker, worker->handoff_efd, worker->handoff_event, UOP_HANDOFF);
+    }
+}
+
+static void uring_handle_tick(struct server_worker *worker, struct io_uring_cqe *cqe) {
+    struct worker_uring *u = worker_uring(worker);
+
+    worker_expire_timers(worker);
+
+    if ( !(cqe->flags & IORING_CQE_F_MORE) ) {
+        u->inflight--;
+        if ( !worker_stopping(worker) ) uring_arm_poll(worker, worker->timerfd, worker->timer_event, UOP_TICK);
+    }
+}
+
+static void uring_reap(struct server_worker *worker) {
+    struct worker_uring *u = worker_uring(worker);
+    struct io_uring_cqe *cqe;
+    unsigned accepted = 0;
+
+    while ( (cqe = uring_peek_cqe(&u->ring)) != NULL ) {
+        void *ptr = uring_ud_ptr(cqe->user_data);
+        struct server_worker_event *event = ptr;
+
+        switch ( cqe->user_data & UOP_MASK ) {
+            case UOP_RECV: uring_handle_recv(worker, event->data.client, cqe); break;
+            case UOP_SEND: uring_handle_send(worker, ptr, cqe->res); break;
+            case UOP_TICK: uring_handle_tick(worker, cqe); break;
+            case UOP_ACCEPT: accepted += uring_handle_accept(worker, event->data.listener, cqe); break;
+            case UOP_HANDOFF: uring_handle_handoff(worker, cqe); break;
+            case UOP_IGNORE: break;
+            default: assert(0);
+        }
+
+        uring_cqe_seen(&u->ring);
+    }
+
+    // Multishot accept has no wakeups of its own, we count reaps that brought connections
+    if ( accepted > 0 ) server_accept_stats_account(&worker->accept_stats, accepted);
+}
+
+static void uring_loop(struct server_worker *worker) {
+    struct worker_uring *u = worker_uring(worker);
+
+    while ( !worker_stopping(worker) ) {
+        // One syscall submits everything the previous completions produced and waits for new ones
+        if ( uring_submit_and_wait(&u->ring, 1) == -1 && errno != EBUSY ) {
+            log_msg(LOG_CRITICAL, "io_uring_enter failed on worker %p: %s\n", worker, strerror(errno));
+        }
+        uring_reap(worker);
+    }
+}
+
+/*
+ * Kernels before 6.0 fail multishot recv with EINVAL, so we try one on a socketpair before the ring is used.
+ * The byte is queued first, the recv completes with it at once and then with EOF after the shutdown
+ */
+static int uring_probe_multishot_recv(struct worker_uring *u) {
+    int sv[2];
+    if ( socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) ) return -1;
+
+    int ret = -1;
+    if ( write(sv[1], "", 1) != 1 ) goto close_sv;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = uring_ud(NULL, UOP_IGNORE);
+
+    bool more = true;
+    while ( more ) {
+        struct io_uring_cqe *cqe = uring_peek_cqe(&u->ring);
+        if ( cqe == NULL ) {
+            if ( uring_submit_and_wait(&u->ring, 1) == -1 && errno != EINTR ) goto close_sv;
+            continue;
+        }
+
+        if ( cqe->flags & IORING_CQE_F_BUFFER ) {
+            uring_buf_ring_recycle(&u->bufs, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        more = cqe->flags & IORING_CQE_F_MORE;
+        if ( cqe->res == 1 && more ) {
+            ret = 0;
+            shutdown(sv[0], SHUT_RDWR);   // Ends the multishot
+        }
+        uring_cqe_seen(&u->ring);
+    }
+
+    if ( ret ) errno = ENOSYS;
+
+close_sv:
+    close(sv[0]);
+    close(sv[1]);
+    return ret;
+}
+
+static int uring_worker_init(struct server_worker *worker) {
+    struct worker_uring *u = malloc(sizeof(struct worker_uring));
+    if ( u == NULL ) return -1;
+
+    if ( uring_init(&u->ring, URING_ENTRIES) ) goto free_u;
+
+    if ( (u->ring.features & URING_REQUIRED_FEATURES) != URING_REQUIRED_FEATURES ) {
+        errno = ENOSYS;
+        goto fini_ring;
+    }
+
+    if ( uring_buf_ring_init(&u->ring, &u->bufs, URING_BGID, URING_BUFS_NR, URING_BUF_SIZE) ) goto fini_ring;
+    if ( uring_probe_multishot_recv(u) ) goto fini_bufs;
+
+    slab_cache_init(&u->sends_cache, sizeof(struct uring_send), URING_SENDS_PER_SLAB);
+    u->inflight = 0;
+    u->listeners_dirty = false;
+    worker->backend_data = u;
+
+    // The worker thread submits them
+    uring_arm_poll(worker, worker->handoff_efd, worker->handoff_event, UOP_HANDOFF);
+    uring_arm_poll(worker, worker->timerfd, worker->timer_event, UOP_TICK);
+    return 0;
+
+fini_bufs:
+    uring_buf_ring_fini(&u->ring, &u->bufs);
+fini_ring:
+    uring_fini(&u->ring);
+free_u:
+    free(u);
+    return -1;
+}
+
+static void uring_worker_fini(struct server_worker *worker) {
+    struct worker_uring *u = worker_uring(worker);
+    assert(worker_stopping(worker));   // Nothing is armed again
+
+    // The worker thread is gone, so we drive the ring. Everything in flight holds memory we have to free
+    while ( u->inflight > 0 ) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+        sqe->user_data = uring_ud(NULL, UOP_IGNORE);
+
+        uring_submit_and_wait(&u->ring, 1);
+        uring_reap(worker);
+    }
+
+    slab_cache_fini(&u->sends_cache);   // The last send completions are reaped
+    uring_buf_ring_fini(&u->ring, &u->bufs);
+    uring_fini(&u->ring);
+    free(u);
+    worker->backend_data = NULL;
+}
+
+const struct server_worker_backend server_worker_uring_backend = {
+    .name = "uring",
+    .init = uring_worker_init,
+    .fini = uring_worker_fini,
+    .loop = uring_loop,
+    .client_watch = uring_client_watch,
+    .client_send = uring_client_send,
+    .client_release = uring_client_release,
+    .listener_watch = uring_listener_watch,
+    .listener_unwatch = uring_listener_unwatch
+};
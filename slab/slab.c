@@ -0,0 +1,91 @@
+#include "slab.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#define SLAB_OBJ_ALIGN ((size_t)__BIGGEST_ALIGNMENT__)   // Like malloc, objects can hold anything
+
+struct slab {
+    struct slab *next;
+    [[gnu::aligned]] unsigned char objs[];
+};
+
+void slab_cache_init(struct slab_cache *sc, size_t obj_size, unsigned objs_per_slab) {
+    assert(sc);
+    assert(objs_per_slab > 0);
+
+    if ( obj_size < sizeof(void *) ) obj_size = sizeof(void *);   // Room for the free list link
+    sc->obj_size = (obj_size + SLAB_OBJ_ALIGN - 1) & ~(SLAB_OBJ_ALIGN - 1);
+    sc->objs_per_slab = objs_per_slab;
+    sc->free_objs = NULL;
+    sc->slabs = NULL;
+    sc->stats = (struct slab_stats){0};
+}
+
+void slab_cache_fini(struct slab_cache *sc) {
+    assert(sc);
+    assert(sc->stats.objs == 0);
+
+    while ( sc->slabs != NULL ) {
+        struct slab *slab = sc->slabs;
+        sc->slabs = slab->next;
+        free(slab);
+    }
+    sc->free_objs = NULL;
+}
+
+static int slab_cache_grow(struct slab_cache *sc) {
+    struct slab *slab = malloc(sizeof(struct slab) + sc->obj_size * sc->objs_per_slab);
+    if ( slab == NULL ) return -1;
+
+    slab->next = sc->slabs;
+    sc->slabs = slab;
+
+    // Backwards, so the objects are handed out in address order
+    for ( unsigned i = sc->objs_per_slab; i > 0; i-- ) {
+        void **obj = (void **)(slab->objs + (i - 1) * sc->obj_size);
+        *obj = sc->free_objs;
+        sc->free_objs = obj;
+    }
+
+    __atomic_store_n(&sc->stats.slabs, sc->stats.slabs + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void *slab_alloc(struct slab_cache *sc) {
+    assert(sc);
+
+    if ( sc->free_objs == NULL && slab_cache_grow(sc) ) return NULL;
+
+    void **obj = sc->free_objs;
+    sc->free_objs = *obj;
+
+    // Only the owner writes the stats, so plain read-modify-write is enough
+    unsigned long objs = sc->stats.objs + 1;
+    __atomic_store_n(&sc->stats.objs, objs, __ATOMIC_RELAXED);
+    __atomic_store_n(&sc->stats.allocs, sc->stats.allocs + 1, __ATOMIC_RELAXED);
+    if ( sc->stats.peak_objs < objs ) __atomic_store_n(&sc->stats.peak_objs, objs, __ATOMIC_RELAXED);
+
+    return obj;
+}
+
+void slab_free(struct slab_cache *sc, void *obj) {
+    assert(sc);
+    if ( obj == NULL ) return;
+
+    assert(sc->stats.objs > 0);
+    *(void **)obj = sc->free_objs;
+    sc->free_objs = obj;
+
+    __atomic_store_n(&sc->stats.objs, sc->stats.objs - 1, __ATOMIC_RELAXED);
+}
+
+void slab_stats_merge(struct slab_stats *dest, const struct slab_cache *src) {
+    assert(dest);
+    assert(src);
+
+    dest->slabs += __atomic_load_n(&src->stats.slabs, __ATOMIC_RELAXED);
+    dest->objs += __atomic_load_n(&src->stats.objs, __ATOMIC_RELAXED);
+    dest->peak_objs += __atomic_load_n(&src->stats.peak_objs, __ATOMIC_RELAXED);
+    dest->allocs += __atomic_load_n(&src->stats.allocs, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Fixed-size object cache. Objects are carved from slabs that go back to malloc only in slab_cache_fini,
+ * so once the cache has grown to the peak, alloc and free are a couple of pointer moves.
+ * The cache isn't thread safe, only its owner allocates and frees. Stats can be read from any thread.
+ */
+
+struct slab_stats {
+    unsigned long slabs;       // Slabs taken from malloc
+    unsigned long objs;        // Objects in use
+    unsigned long peak_objs;   // Max objects in use at once
+    unsigned long allocs;      // Total slab_alloc calls that succeeded
+};
+
+struct slab;
+
+struct slab_cache {
+    size_t obj_size;
+    unsigned objs_per_slab;
+    void *free_objs;   // Linked through the first bytes of the free objects
+    struct slab *slabs;
+    struct slab_stats stats;
+};
+
+extern void slab_cache_init(struct slab_cache *sc, size_t obj_size, unsigned objs_per_slab);
+// All objects have to be freed already
+extern void slab_cache_fini(struct slab_cache *sc);
+
+[[gnu::malloc]]
+extern void *slab_alloc(struct slab_cache *sc);
+extern void slab_free(struct slab_cache *sc, void *obj);
+
+// Adds the counters of src to dest, merged peaks are the sum of the caches' own peaks
+extern void slab_stats_merge(struct slab_stats *dest, const struct slab_cache *src);
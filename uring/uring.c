@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "utils.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(struct uring *ring, unsigned entries) {
+    assert(ring);
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if ( ring->fd == -1 && errno == EINVAL ) {   // Older kernels don't know these flags
+        memset(&p, 0, sizeof(p));
+        ring->fd = sys_io_uring_setup(entries, &p);
+    }
+    if ( ring->fd == -1 ) return -1;
+
+    if ( !(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) ) {
+        errno = ENOSYS;   // Too old to bother
+        goto close_fd;
+    }
+
+    ring->features = p.features;
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sq_ring_size = max(ring->sq_ring_size, ring->cq_ring_size);
+    ring->cq_ring_size = ring->sq_ring_size;   // Single mmap for both rings
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(
+        NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING
+    );
+    if ( ring->sq_ring == MAP_FAILED ) goto close_fd;
+    ring->cq_ring = ring->sq_ring;
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if ( ring->sqes == MAP_FAILED ) goto unmap_ring;
+
+    ring->sq_head = shiftptr((unsigned *)ring->sq_ring, p.sq_off.head);
+    ring->sq_tail = shiftptr((unsigned *)ring->sq_ring, p.sq_off.tail);
+    ring->sq_mask = *shiftptr((unsigned *)ring->sq_ring, p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->submits = 0;
+
+    // We always use sqes in order, so the indirection array is the identity
+    unsigned *sq_array = shiftptr((unsigned *)ring->sq_ring, p.sq_off.array);
+    for ( unsigned i = 0; i < p.sq_entries; i++ ) sq_array[i] = i;
+
+    ring->cq_head = shiftptr((unsigned *)ring->cq_ring, p.cq_off.head);
+    ring->cq_tail = shiftptr((unsigned *)ring->cq_ring, p.cq_off.tail);
+    ring->cq_mask = *shiftptr((unsigned *)ring->cq_ring, p.cq_off.ring_mask);
+    ring->cqes = shiftptr((struct io_uring_cqe *)ring->cq_ring, p.cq_off.cqes);
+
+    return 0;
+
+unmap_ring:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+close_fd:
+    close(ring->fd);
+    return -1;
+}
+
+void uring_fini(struct uring *ring) {
+    assert(ring);
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// Publishes prepared sqes, returns how many of them the kernel hasn't seen yet
+static unsigned uring_flush_sq(struct uring *ring) {
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    return ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr) {
+    assert(ring);
+
+    unsigned to_submit = uring_flush_sq(ring);
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    ring->submits++;
+
+    while ( true ) {
+        int res = sys_io_uring_enter(ring->fd, to_submit, wait_nr, flags);
+        if ( res == -1 && errno == EINTR ) {
+            to_submit = uring_flush_sq(ring);
+            continue;
+        }
+        return res;
+    }
+}
+
+void uring_reserve_sqes(struct uring *ring, unsigned nr) {
+    assert(ring);
+    assert(nr <= ring->sq_entries);
+
+    while ( ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_entries - nr ) {
+        uring_submit_and_wait(ring, 0);   // SQ is full, let the kernel consume it
+    }
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    assert(ring);
+
+    uring_reserve_sqes(ring, 1);
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    ring->sqe_tail++;
+
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+    assert(ring);
+
+    unsigned head = *ring->cq_head;
+    if ( head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) ) return NULL;
+
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+    assert(ring);
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_buf_ring_init(
+    struct uring *ring, struct uring_buf_ring *bring, unsigned short bgid, unsigned entries, size_t buf_size
+) {
+    assert(ring);
+    assert(bring);
+    assert(entries > 0 && (entries & (entries - 1)) == 0);   // The kernel wants a power of two
+    assert(entries <= 32768);
+
+    size_t ring_size = entries * sizeof(struct io_uring_buf);
+    bring->br = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( bring->br == MAP_FAILED ) return -1;
+
+    size_t bufs_size;
+    if ( ckd_mul(&bufs_size, buf_size, entries) ) goto unmap_br;
+    bring->bufs = malloc(bufs_size);
+    if ( bring->bufs == NULL ) goto unmap_br;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)bring->br;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+
+    if ( sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) ) goto free_bufs;
+
+    bring->entries = entries;
+    bring->bgid = bgid;
+    bring->buf_size = buf_size;
+
+    bring->br->tail = 0;
+    for ( unsigned i = 0; i < entries; i++ ) uring_buf_ring_recycle(bring, i);
+
+    return 0;
+
+free_bufs:
+    free(bring->bufs);
+unmap_br:
+    munmap(bring->br, ring_size);
+    return -1;
+}
+
+void uring_buf_ring_fini(struct uring *ring, struct uring_buf_ring *bring) {
+    assert(ring);
+    assert(bring);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = bring->bgid;
+    sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+    munmap(bring->br, bring->entries * sizeof(struct io_uring_buf));
+    free(bring->bufs);
+}
+
+void *uring_buf_ring_get(struct uring_buf_ring *bring, unsigned short bid) {
+    assert(bring);
+    assert(bid < bring->entries);
+    return shiftptr(bring->bufs, bring->buf_size * bid);
+}
+
+void uring_buf_ring_recycle(struct uring_buf_ring *bring, unsigned short bid) {
+    assert(bring);
+
+    unsigned short tail = bring->br->tail;
+    struct io_uring_buf *buf = &bring->br->bufs[tail & (bring->entries - 1)];
+    buf->addr = (unsigned long)uring_buf_ring_get(bring, bid);
+    buf->len = bring->buf_size;
+    buf->bid = bid;
+
+    __atomic_store_n(&bring->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
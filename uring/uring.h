@@ -0,0 +1,62 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A tiny io_uring wrapper on top of the raw syscalls.
+ * The ring isn't thread safe, only one thread should submit and reap.
+ */
+struct uring {
+    int fd;
+    unsigned features;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;   // Prepared, but not yet published sqes end here
+    unsigned submits;    // Incremented every time the prepared sqes are flushed to the kernel
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+// Returns -1 and sets errno if the kernel doesn't support io_uring
+extern int uring_init(struct uring *ring, unsigned entries);
+extern void uring_fini(struct uring *ring);
+
+// Never returns NULL, it submits prepared sqes on its own if the queue is full
+extern struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+// Makes room for nr sqes, so a linked chain taken right after it isn't split between two submits
+extern void uring_reserve_sqes(struct uring *ring, unsigned nr);
+extern int uring_submit_and_wait(struct uring *ring, unsigned wait_nr);
+
+extern struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+extern void uring_cqe_seen(struct uring *ring);
+
+// Ring of the same sized buffers the kernel picks from for IOSQE_BUFFER_SELECT requests
+struct uring_buf_ring {
+    struct io_uring_buf_ring *br;
+    unsigned entries;
+    unsigned short bgid;
+    size_t buf_size;
+    void *bufs;
+};
+
+extern int uring_buf_ring_init(
+    struct uring *ring, struct uring_buf_ring *bring, unsigned short bgid, unsigned entries, size_t buf_size
+);
+extern void uring_buf_ring_fini(struct uring *ring, struct uring_buf_ring *bring);
+extern void *uring_buf_ring_get(struct uring_buf_ring *bring, unsigned short bid);
+extern void uring_buf_ring_recycle(struct uring_buf_ring *bring, unsigned short bid);
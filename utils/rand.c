@@ -0,0 +1,135 @@
+#include "rand.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include "utils.h"
+
+struct rand_state {
+    uint64_t s[4];
+    bool seeded;
+};
+
+static __thread struct rand_state rand_state;
+
+static bool rand_seeded;      // Atomic, rand_seed was called
+static uint64_t rand_base;    // Atomic, the rand_seed seed
+static uint64_t rand_threads; // Atomic, threads seeded from rand_base so far
+
+static uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+[[gnu::noinline]]
+static void rand_state_seed(struct rand_state *st) {
+    uint64_t x;
+
+    if ( __atomic_load_n(&rand_seeded, __ATOMIC_ACQUIRE) ) {
+        uint64_t nr = __atomic_fetch_add(&rand_threads, 1, __ATOMIC_RELAXED);
+        x = __atomic_load_n(&rand_base, __ATOMIC_RELAXED) + nr * 0xd1b54a32d192ed03ull;
+    } else if ( getrandom(&x, sizeof(x), 0) != sizeof(x) ) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        x = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+        x ^= (uint64_t)(uintptr_t)st;   // Different for every thread
+    }
+
+    // splitmix64 never gives four zero words, which is the only state xoshiro can't leave
+    for ( unsigned i = 0; i < countof(st->s); i++ ) {
+        st->s[i] = splitmix64(&x);
+    }
+    st->seeded = true;
+}
+
+uint64_t rand_u64(void) {
+    struct rand_state *st = &rand_state;
+    if ( !st->seeded ) rand_state_seed(st);
+
+    uint64_t *s = st->s;
+    uint64_t res = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return res;
+}
+
+uint32_t rand_u32(void) {
+    return rand_u64() >> 32;   // The high bits are the better ones
+}
+
+// Lemire's multiply-shift, redraws only for the low products that would make some results more likely
+uint32_t rand_below(uint32_t bound) {
+    assert(bound != 0);
+
+    uint64_t m = (uint64_t)rand_u32() * bound;
+    uint32_t low = (uint32_t)m;
+    if ( low < bound ) {
+        uint32_t threshold = -bound % bound;
+        while ( low < threshold ) {
+            m = (uint64_t)rand_u32() * bound;
+            low = (uint32_t)m;
+        }
+    }
+
+    return m >> 32;
+}
+
+void rand_fill(void *buf, size_t len) {
+    char *p = buf;
+
+    while ( len >= sizeof(uint64_t) ) {
+        uint64_t x = rand_u64();
+        memcpy(p, &x, sizeof(x));
+        p += sizeof(x);
+        len -= sizeof(x);
+    }
+
+    if ( len != 0 ) {
+        uint64_t x = rand_u64();
+        memcpy(p, &x, len);
+    }
+}
+
+void rand_fill_chars(char *buf, size_t len, char lo, char hi) {
+    assert(lo <= hi);
+
+    // A 16-bit draw per char is plenty for a byte range, so one rand_u64 serves four chars
+    uint32_t bound = (uint32_t)(hi - lo) + 1;
+    uint32_t threshold = (uint32_t)(65536 % bound);
+    uint64_t bits = 0;
+    unsigned bits_nr = 0;
+
+    for ( size_t i = 0; i < len; ) {
+        if ( bits_nr == 0 ) {
+            bits = rand_u64();
+            bits_nr = 4;
+        }
+        uint32_t m = (uint32_t)(bits & 0xffff) * bound;
+        bits >>= 16;
+        bits_nr--;
+
+        if ( (m & 0xffff) < threshold ) continue;   // Biased, redraw
+        buf[i++] = (char)(lo + (m >> 16));
+    }
+}
+
+void rand_seed(uint64_t seed) {
+    __atomic_store_n(&rand_base, seed, __ATOMIC_RELAXED);
+    __atomic_store_n(&rand_threads, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&rand_seeded, true, __ATOMIC_RELEASE);
+    rand_state.seeded = false;   // The caller draws from the seed too
+}
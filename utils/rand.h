@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Per-thread xoshiro256** generators. A thread seeds its state on the first draw, from getrandom or from
+ * the rand_seed seed and the order the threads came in, and never touches shared state afterwards
+ */
+extern uint64_t rand_u64(void);
+extern uint32_t rand_u32(void);
+// Unbiased draw from [0, bound), bound must not be 0
+extern uint32_t rand_below(uint32_t bound);
+extern void rand_fill(void *buf, size_t len);
+// Unbiased chars from [lo, hi]
+extern void rand_fill_chars(char *buf, size_t len, char lo, char hi);
+
+// The caller and the threads that haven't drawn yet derive their state from seed, for reproducible runs
+extern void rand_seed(uint64_t seed);